@@ -0,0 +1,95 @@
+/**
+ * @file arena.c
+ * @author wuyangjun (wuyangjun21@163.com)
+ * @brief statement arena: bump allocation in chunks which are recycled, not freed, for the
+ *        tokens, nodes and types of one statement in streaming compilation (--stream)
+ * @version 0.1
+ * @date 2022-09-08
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "chibicc_wyj.h"
+
+// most statements fit in one chunk
+#define ARENA_CHUNK (64 << 10)
+
+typedef struct Chunk Chunk;
+struct Chunk {
+    Chunk *next;
+    size_t cap;
+    size_t used;
+    _Alignas(16) char data[];
+};
+
+static _Thread_local bool active;
+static _Thread_local Chunk *chunks;         // in use, newest first
+static _Thread_local Chunk *free_chunks;    // released by `arena_reset`, taken before malloc
+
+// allocations of this thread come from the arena until `arena_end`
+void arena_begin(void) {
+    active = true;
+}
+
+static Chunk *new_chunk(size_t size) {
+    // a released chunk which is big enough, there are few of them
+    for (Chunk **p = &free_chunks; *p; p = &(*p)->next) {
+        if ((*p)->cap >= size) {
+            Chunk *chunk = *p;
+            *p = chunk->next;
+            return chunk;
+        }
+    }
+    size_t cap = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+    Chunk *chunk = malloc(sizeof(Chunk) + cap);
+    if (!chunk)
+        error("out of memory");
+    chunk->cap = cap;
+    return chunk;
+}
+
+// zeroed memory: from the arena while it's active on this thread, calloc otherwise
+void *arena_alloc(size_t size) {
+    if (!active)
+        return calloc(1, size);
+
+    size = (size + 15) / 16 * 16;
+    if (!chunks || chunks->used + size > chunks->cap) {
+        Chunk *chunk = new_chunk(size);
+        chunk->used = 0;
+        chunk->next = chunks;
+        chunks = chunk;
+    }
+    void *p = chunks->data + chunks->used;
+    chunks->used += size;
+    memset(p, 0, size);
+    return p;
+}
+
+char *arena_strndup(char *s, size_t len) {
+    char *p = arena_alloc(len + 1);
+    memcpy(p, s, len);
+    return p;
+}
+
+// everything allocated so far is dead, its chunks serve the next statement
+void arena_reset(void) {
+    while (chunks) {
+        Chunk *chunk = chunks;
+        chunks = chunk->next;
+        chunk->next = free_chunks;
+        free_chunks = chunk;
+    }
+}
+
+// back to calloc, the chunks are freed
+void arena_end(void) {
+    arena_reset();
+    while (free_chunks) {
+        Chunk *chunk = free_chunks;
+        free_chunks = chunk->next;
+        free(chunk);
+    }
+    active = false;
+}
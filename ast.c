@@ -0,0 +1,526 @@
+/**
+ * @file ast.c
+ * @author wuyangjun (wuyangjun21@163.com)
+ * @brief binary AST format: a position-independent image of the typed AST (Function, Node, Variable, Type),
+ *        all links are indices into flat record tables, so the file can be mmap'd and loaded
+ *        straight into codegen without tokenize/parse
+ * @version 0.1
+ * @date 2022-08-31
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "chibicc_wyj.h"
+
+// file layout:
+//   AstHeader | AstType[ntypes] | AstFunc[nfuncs] | int32_t params[nparams] | AstVar[nvars]
+//   | AstNode[nnodes] | source text | names
+// every section is 8-byte aligned, a link of -1 means NULL
+// node and variable links always point to a later record, so a valid file has no cycles
+#define AST_MAGIC "CWYJAST"
+#define AST_VERSION 4
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t ntypes;
+    uint32_t nfuncs;
+    uint32_t nparams;
+    uint32_t nvars;
+    uint32_t nnodes;
+    uint64_t src_len;   // source text, tokens point into it for diagnostics
+    uint64_t names_len; // NUL-terminated function and variable names
+} AstHeader;
+
+typedef struct {
+    uint32_t name;      // offset into names
+    int32_t locals;     // head of Function::locals
+    int32_t body;       // Function::body
+    uint32_t params;    // first entry in the params table
+    uint32_t nparams;
+    uint32_t pad;
+} AstFunc;
+
+typedef struct {
+    uint32_t kind;
+    int32_t base;
+} AstType;
+
+typedef struct {
+    int32_t next;
+    uint32_t name;      // offset into names
+    int32_t ty;
+    uint32_t pad;
+} AstVar;
+
+typedef struct {
+    uint32_t kind;
+    int32_t value;
+    uint32_t loc;       // token offset into source text
+    uint32_t len;       // token length
+    int32_t ty;
+    int32_t lvar;
+    int32_t lhs, rhs, next, body, cond, then, els, init, inc;
+    int32_t funcname;   // offset into names, -1 if not a call
+    int32_t args;
+} AstNode;
+
+//
+// pointer => index map, open addressing
+//
+
+typedef struct {
+    void **keys;
+    int *vals;
+    int cap;
+    int cnt;
+} PtrMap;
+
+static uint64_t hash_ptr(void *p) {
+    uint64_t x = (uintptr_t)p;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static void map_put(PtrMap *m, void *key, int val);
+
+static void map_grow(PtrMap *m) {
+    PtrMap old = *m;
+    m->cap = old.cap ? old.cap * 2 : 64;
+    m->cnt = 0;
+    m->keys = calloc(m->cap, sizeof(void *));
+    m->vals = calloc(m->cap, sizeof(int));
+    for (int i = 0; i < old.cap; i++) {
+        if (old.keys[i])
+            map_put(m, old.keys[i], old.vals[i]);
+    }
+    free(old.keys);
+    free(old.vals);
+}
+
+static void map_put(PtrMap *m, void *key, int val) {
+    if ((m->cnt + 1) * 2 > m->cap)
+        map_grow(m);
+    int i = hash_ptr(key) & (m->cap - 1);
+    while (m->keys[i] && m->keys[i] != key) {
+        i = (i + 1) & (m->cap - 1);
+    }
+    if (!m->keys[i])
+        m->cnt++;
+    m->keys[i] = key;
+    m->vals[i] = val;
+}
+
+static int map_get(PtrMap *m, void *key) {
+    if (!key || !m->cap)
+        return -1;
+    for (int i = hash_ptr(key) & (m->cap - 1); m->keys[i]; i = (i + 1) & (m->cap - 1)) {
+        if (m->keys[i] == key)
+            return m->vals[i];
+    }
+    return -1;
+}
+
+//
+// Emit
+//
+
+typedef struct {
+    PtrMap types;
+    PtrMap nodes;
+    PtrMap vars;
+    Type **type_list;
+    Node **node_list;
+    int ntypes;
+    int nnodes;
+    int cap_types;
+    int cap_nodes;
+    char *names;
+    size_t names_len;
+    size_t cap_names;
+} Emitter;
+
+// append a name to the names section, return its offset
+static int add_name(Emitter *e, char *name) {
+    size_t len = strlen(name) + 1;
+    if (e->names_len + len > e->cap_names) {
+        e->cap_names = e->cap_names ? e->cap_names * 2 : 256;
+        if (e->cap_names < e->names_len + len)
+            e->cap_names = e->names_len + len;
+        e->names = realloc(e->names, e->cap_names);
+    }
+    memcpy(e->names + e->names_len, name, len);
+    e->names_len += len;
+    return e->names_len - len;
+}
+
+static int emit_type(Emitter *e, Type *ty) {
+    if (!ty)
+        return -1;
+    if (ty == ty_int)
+        return 0;
+    int idx = map_get(&e->types, ty);
+    if (idx != -1)
+        return idx;
+
+    // base first, so that loading never sees a forward link
+    emit_type(e, ty->base);
+    if (e->ntypes == e->cap_types) {
+        e->cap_types = e->cap_types ? e->cap_types * 2 : 64;
+        e->type_list = realloc(e->type_list, e->cap_types * sizeof(Type *));
+    }
+    idx = e->ntypes++;
+    e->type_list[idx] = ty;
+    map_put(&e->types, ty, idx);
+    return idx;
+}
+
+#define NLINKS 10
+
+// the node links of `node`, NULL where there is none
+static void node_links(Node *node, Node *links[NLINKS]) {
+    Node *l[NLINKS] = {node->lhs, node->rhs, node->next, node->body, node->cond,
+                       node->then, node->els, node->init, node->inc, node->args};
+    memcpy(links, l, sizeof(l));
+}
+
+typedef struct {
+    Node *node;
+    int link;   // next link to follow
+} Frame;
+
+/**
+ * @brief append every node reachable from `root` in postorder, on an explicit stack
+ *
+ * A node is only appended after everything it links to, so once the whole list is
+ * reversed (`number_nodes`) every link points to a later node.
+ */
+static void collect_nodes(Emitter *e, Node *root) {
+    if (!root || map_get(&e->nodes, root) != -1)
+        return;
+    int depth = 0, cap = 64;
+    Frame *stack = malloc(cap * sizeof(Frame));
+    // -2: seen, but not numbered yet
+    map_put(&e->nodes, root, -2);
+    stack[depth++] = (Frame){root, 0};
+
+    while (depth > 0) {
+        Frame *f = &stack[depth - 1];
+        Node *links[NLINKS];
+        node_links(f->node, links);
+        while (f->link < NLINKS && (!links[f->link] || map_get(&e->nodes, links[f->link]) != -1))
+            f->link++;
+
+        if (f->link < NLINKS) {
+            Node *child = links[f->link++];
+            map_put(&e->nodes, child, -2);
+            if (depth == cap) {
+                cap *= 2;
+                stack = realloc(stack, cap * sizeof(Frame));
+            }
+            stack[depth++] = (Frame){child, 0};
+            continue;
+        }
+
+        if (e->nnodes == e->cap_nodes) {
+            e->cap_nodes = e->cap_nodes ? e->cap_nodes * 2 : 256;
+            e->node_list = realloc(e->node_list, e->cap_nodes * sizeof(Node *));
+        }
+        e->node_list[e->nnodes++] = f->node;
+        emit_type(e, f->node->ty);
+        depth--;
+    }
+    free(stack);
+}
+
+// reverse postorder: parents before children
+static void number_nodes(Emitter *e) {
+    for (int i = 0, j = e->nnodes - 1; i < j; i++, j--) {
+        Node *tmp = e->node_list[i];
+        e->node_list[i] = e->node_list[j];
+        e->node_list[j] = tmp;
+    }
+    for (int i = 0; i < e->nnodes; i++) {
+        map_put(&e->nodes, e->node_list[i], i);
+    }
+}
+
+static void write_pad(FILE *out, size_t len) {
+    static char zero[8];
+    fwrite(zero, 1, (8 - len % 8) % 8, out);
+}
+
+/**
+ * @brief write the program `prog` in the binary AST format
+ *
+ * @param src source text `prog` was parsed from, token locations are stored as offsets into it
+ */
+void emit_ast(Function *prog, char *src, size_t len, FILE *out) {
+    // type 0 is always `ty_int`
+    Emitter e = {};
+    e.type_list = calloc(64, sizeof(Type *));
+    e.cap_types = 64;
+    e.type_list[e.ntypes++] = ty_int;
+
+    int nfuncs = 0, nparams = 0, nvars = 0;
+    for (Function *fn = prog; fn; fn = fn->next) {
+        collect_nodes(&e, fn->body);
+        for (Variable *v = fn->locals; v; v = v->next) {
+            emit_type(&e, v->ty);
+            map_put(&e.vars, v, nvars++);
+        }
+        nfuncs++;
+        nparams += fn->nparams;
+    }
+    number_nodes(&e);
+
+    // names are only known once the records are written, so the header goes last
+    char *body;
+    size_t body_len;
+    FILE *hdr_out = out;
+    out = open_memstream(&body, &body_len);
+
+    for (int i = 0; i < e.ntypes; i++) {
+        Type *ty = e.type_list[i];
+        AstType rec = {ty->kind, emit_type(&e, ty->base)};
+        fwrite(&rec, sizeof(rec), 1, out);
+    }
+
+    uint32_t param = 0;
+    for (Function *fn = prog; fn; fn = fn->next) {
+        AstFunc rec = {add_name(&e, fn->name), map_get(&e.vars, fn->locals),
+                       map_get(&e.nodes, fn->body), param, fn->nparams};
+        fwrite(&rec, sizeof(rec), 1, out);
+        param += fn->nparams;
+    }
+    for (Function *fn = prog; fn; fn = fn->next) {
+        for (int i = 0; i < fn->nparams; i++) {
+            int32_t idx = map_get(&e.vars, fn->params[i]);
+            fwrite(&idx, sizeof(idx), 1, out);
+        }
+    }
+    write_pad(out, sizeof(int32_t) * nparams);
+
+    for (Function *fn = prog; fn; fn = fn->next) {
+        for (Variable *v = fn->locals; v; v = v->next) {
+            AstVar rec = {map_get(&e.vars, v->next), add_name(&e, v->name), emit_type(&e, v->ty)};
+            fwrite(&rec, sizeof(rec), 1, out);
+        }
+    }
+    write_pad(out, sizeof(AstVar) * nvars);
+
+    for (int i = 0; i < e.nnodes; i++) {
+        Node *n = e.node_list[i];
+        AstNode rec = {
+            n->kind, n->value,
+            n->tok ? n->tok->loc - src : 0, n->tok ? n->tok->len : 0,
+            emit_type(&e, n->ty), map_get(&e.vars, n->lvar),
+            map_get(&e.nodes, n->lhs), map_get(&e.nodes, n->rhs), map_get(&e.nodes, n->next),
+            map_get(&e.nodes, n->body), map_get(&e.nodes, n->cond), map_get(&e.nodes, n->then),
+            map_get(&e.nodes, n->els), map_get(&e.nodes, n->init), map_get(&e.nodes, n->inc),
+            n->funcname ? add_name(&e, n->funcname) : -1, map_get(&e.nodes, n->args),
+        };
+        fwrite(&rec, sizeof(rec), 1, out);
+    }
+    write_pad(out, sizeof(AstNode) * e.nnodes);
+
+    fwrite(src, 1, len, out);
+    write_pad(out, len);
+    fwrite(e.names, 1, e.names_len, out);
+    fclose(out);
+
+    AstHeader hdr = {AST_MAGIC, AST_VERSION, e.ntypes, nfuncs, nparams, nvars, e.nnodes,
+                     len, e.names_len};
+    fwrite(&hdr, sizeof(hdr), 1, hdr_out);
+    fwrite(body, 1, body_len, hdr_out);
+    free(body);
+
+    free(e.names);
+    free(e.type_list);
+    free(e.node_list);
+    free(e.types.keys);
+    free(e.types.vals);
+    free(e.nodes.keys);
+    free(e.nodes.vals);
+    free(e.vars.keys);
+    free(e.vars.vals);
+}
+
+//
+// Load
+//
+
+static size_t align8(size_t n) {
+    return (n + 7) / 8 * 8;
+}
+
+// validate a link read from the file
+static int check_idx(int32_t idx, uint32_t cnt) {
+    if (idx < -1 || idx >= (int64_t)cnt)
+        error("invalid AST file: link %d out of range", idx);
+    return idx;
+}
+
+// same as above for a link of record `from`, which must point to a later record
+static int check_link(int32_t idx, uint32_t from, uint32_t cnt) {
+    if (check_idx(idx, cnt) != -1 && idx <= (int64_t)from)
+        error("invalid AST file: link %d of record %u is not forward", idx, from);
+    return idx;
+}
+
+// children which codegen follows without checking, per node kind
+enum { NEED_LHS = 1, NEED_RHS = 2, NEED_LVAR = 4, NEED_COND = 8, NEED_THEN = 16 };
+
+static int required_links(NodeKind kind) {
+    switch (kind) {
+    case ND_ADD: case ND_SUB: case ND_MUL: case ND_DIV:
+    case ND_EQ: case ND_NE: case ND_LT: case ND_LE: case ND_GT: case ND_GE:
+    case ND_ASSIGN:
+        return NEED_LHS | NEED_RHS;
+    case ND_NEG: case ND_ADDR: case ND_DEREF: case ND_RETURN: case ND_EXPR_STMT:
+        return NEED_LHS;
+    case ND_VAR:
+        return NEED_LVAR;
+    case ND_IF:
+        return NEED_COND | NEED_THEN;
+    case ND_FOR:
+        return NEED_THEN;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief rebuild the program from a binary AST image
+ *
+ * `buf` is typically the read-only mapping of the file; tokens and names
+ * point into it, so it must stay mapped for the rest of the compilation.
+ */
+Function *load_ast(char *name, char *buf, size_t len) {
+    AstHeader *hdr = (AstHeader *)buf;
+    if (len < sizeof(AstHeader) || memcmp(hdr->magic, AST_MAGIC, sizeof(AST_MAGIC)))
+        error("invalid AST file: bad magic");
+    if (hdr->version != AST_VERSION)
+        error("invalid AST file: version %u, expected %u", hdr->version, AST_VERSION);
+
+    size_t types_off = sizeof(AstHeader);
+    size_t funcs_off = types_off + sizeof(AstType) * (size_t)hdr->ntypes;
+    size_t params_off = funcs_off + sizeof(AstFunc) * (size_t)hdr->nfuncs;
+    size_t vars_off = params_off + align8(sizeof(int32_t) * (size_t)hdr->nparams);
+    size_t nodes_off = vars_off + align8(sizeof(AstVar) * (size_t)hdr->nvars);
+    size_t src_off = nodes_off + align8(sizeof(AstNode) * (size_t)hdr->nnodes);
+    size_t names_off = src_off + align8(hdr->src_len);
+    if (hdr->ntypes == 0 || names_off + hdr->names_len > len ||
+        (hdr->names_len && buf[names_off + hdr->names_len - 1] != '\0'))
+        error("invalid AST file: truncated");
+
+    AstType *types = (AstType *)(buf + types_off);
+    AstFunc *funcs = (AstFunc *)(buf + funcs_off);
+    int32_t *params = (int32_t *)(buf + params_off);
+    AstVar *vars = (AstVar *)(buf + vars_off);
+    AstNode *nodes = (AstNode *)(buf + nodes_off);
+    char *src = buf + src_off;
+    char *names = buf + names_off;
+
+    // diagnostics of codegen refer to the original source
+    use_input(name, src, hdr->src_len);
+
+    Type **ty = calloc(hdr->ntypes, sizeof(Type *));
+    ty[0] = ty_int;
+    for (uint32_t i = 1; i < hdr->ntypes; i++) {
+        int base = check_idx(types[i].base, i);
+        if (types[i].kind != TY_INT && types[i].kind != TY_PTR)
+            error("invalid AST file: bad type kind %u", types[i].kind);
+        if (base == -1 && types[i].kind == TY_PTR)
+            error("invalid AST file: pointer without base type");
+        ty[i] = types[i].kind == TY_PTR ? pointer_to(ty[base]) : ty_int;
+    }
+
+    Variable *lvars = calloc(hdr->nvars, sizeof(Variable));
+    for (uint32_t i = 0; i < hdr->nvars; i++) {
+        int next = check_link(vars[i].next, i, hdr->nvars);
+        int t = check_idx(vars[i].ty, hdr->ntypes);
+        if (vars[i].name >= hdr->names_len || t == -1)
+            error("invalid AST file: bad variable");
+        lvars[i].name = names + vars[i].name;
+        lvars[i].ty = ty[t];
+        lvars[i].next = next == -1 ? NULL : &lvars[next];
+    }
+
+    Node *n = calloc(hdr->nnodes, sizeof(Node));
+    Token *toks = calloc(hdr->nnodes, sizeof(Token));
+    #define LINK(field) (check_link(rec->field, i, hdr->nnodes) == -1 ? NULL : &n[rec->field])
+    for (uint32_t i = 0; i < hdr->nnodes; i++) {
+        AstNode *rec = &nodes[i];
+        if (rec->kind > ND_EXPR_STMT)
+            error("invalid AST file: bad node kind %u", rec->kind);
+        if ((uint64_t)rec->loc + rec->len > hdr->src_len)
+            error("invalid AST file: bad token location");
+        if ((rec->kind == ND_FUNCALL) != (rec->funcname != -1) ||
+            (rec->funcname != -1 && (uint32_t)rec->funcname >= hdr->names_len))
+            error("invalid AST file: bad function call");
+        toks[i].loc = src + rec->loc;
+        toks[i].len = rec->len;
+
+        int t = check_idx(rec->ty, hdr->ntypes);
+        int v = check_idx(rec->lvar, hdr->nvars);
+        n[i].kind = rec->kind;
+        n[i].value = rec->value;
+        n[i].tok = &toks[i];
+        n[i].ty = t == -1 ? NULL : ty[t];
+        n[i].lvar = v == -1 ? NULL : &lvars[v];
+        n[i].name = toks[i].loc;
+        n[i].lhs = LINK(lhs);
+        n[i].rhs = LINK(rhs);
+        n[i].next = LINK(next);
+        n[i].body = LINK(body);
+        n[i].cond = LINK(cond);
+        n[i].then = LINK(then);
+        n[i].els = LINK(els);
+        n[i].init = LINK(init);
+        n[i].inc = LINK(inc);
+        n[i].funcname = rec->funcname == -1 ? NULL : names + rec->funcname;
+        n[i].args = LINK(args);
+
+        int need = required_links(rec->kind);
+        if (((need & NEED_LHS) && !n[i].lhs) || ((need & NEED_RHS) && !n[i].rhs) ||
+            ((need & NEED_LVAR) && !n[i].lvar) || ((need & NEED_COND) && !n[i].cond) ||
+            ((need & NEED_THEN) && !n[i].then))
+            error("invalid AST file: node %u of kind %u lacks a required child", i, rec->kind);
+    }
+    #undef LINK
+    free(ty);
+
+    Function head = {};
+    Function *cur = &head;
+    for (uint32_t i = 0; i < hdr->nfuncs; i++) {
+        AstFunc *rec = &funcs[i];
+        int body = check_idx(rec->body, hdr->nnodes);
+        int locals = check_idx(rec->locals, hdr->nvars);
+        if (body == -1)
+            error("invalid AST file: no function body");
+        if (rec->name >= hdr->names_len || rec->nparams > MAX_REG_ARGS ||
+            (uint64_t)rec->params + rec->nparams > hdr->nparams)
+            error("invalid AST file: bad function");
+
+        Function *fn = cur = cur->next = calloc(1, sizeof(Function));
+        fn->name = names + rec->name;
+        fn->body = &n[body];
+        // type nodes that were stored untyped
+        add_type(fn->body);
+        fn->locals = locals == -1 ? NULL : &lvars[locals];
+        fn->params = calloc(MAX_REG_ARGS, sizeof(Variable *));
+        for (uint32_t j = 0; j < rec->nparams; j++) {
+            int v = check_idx(params[rec->params + j], hdr->nvars);
+            if (v == -1)
+                error("invalid AST file: bad parameter");
+            fn->params[fn->nparams++] = &lvars[v];
+        }
+    }
+    if (!head.next)
+        error("invalid AST file: no function");
+    return head.next;
+}
@@ -0,0 +1,359 @@
+/**
+ * @file cache.c
+ * @author wuyangjun (wuyangjun21@163.com)
+ * @brief content-addressed compilation cache: SHA-256(compiler, flags, source) => output,
+ *        entries are published by rename so that concurrent compilers can share a directory,
+ *        and the least recently used entries are evicted when the directory grows too large
+ * @version 0.1
+ * @date 2022-08-30
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "chibicc_wyj.h"
+#include <dirent.h>
+#include <sys/file.h>
+
+//
+// SHA-256 (FIPS 180-4)
+//
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(Sha256 *ctx, const uint8_t *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 | (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    uint32_t a = ctx->h[0], b = ctx->h[1], c = ctx->h[2], d = ctx->h[3];
+    uint32_t e = ctx->h[4], f = ctx->h[5], g = ctx->h[6], h = ctx->h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->h[0] += a; ctx->h[1] += b; ctx->h[2] += c; ctx->h[3] += d;
+    ctx->h[4] += e; ctx->h[5] += f; ctx->h[6] += g; ctx->h[7] += h;
+}
+
+void sha256_init(Sha256 *ctx) {
+    static const uint32_t h0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(ctx->h, h0, sizeof(h0));
+    ctx->len = 0;
+}
+
+void sha256_update(Sha256 *ctx, const void *data, size_t len) {
+    const uint8_t *p = data;
+    size_t used = ctx->len % 64;
+    ctx->len += len;
+
+    if (used) {
+        size_t n = 64 - used < len ? 64 - used : len;
+        memcpy(ctx->buf + used, p, n);
+        p += n;
+        len -= n;
+        if (used + n < 64)
+            return;
+        sha256_block(ctx, ctx->buf);
+    }
+    for (; len >= 64; p += 64, len -= 64) {
+        sha256_block(ctx, p);
+    }
+    memcpy(ctx->buf, p, len);
+}
+
+void sha256_final(Sha256 *ctx, uint8_t digest[32]) {
+    uint64_t bits = ctx->len * 8;
+    uint8_t pad[72] = {0x80};
+    size_t padlen = (ctx->len % 64 < 56) ? 56 - ctx->len % 64 : 120 - ctx->len % 64;
+    for (int i = 0; i < 8; i++) {
+        pad[padlen + i] = bits >> (56 - 8 * i);
+    }
+    sha256_update(ctx, pad, padlen + 8);
+    for (int i = 0; i < 8; i++) {
+        digest[4*i] = ctx->h[i] >> 24;
+        digest[4*i+1] = ctx->h[i] >> 16;
+        digest[4*i+2] = ctx->h[i] >> 8;
+        digest[4*i+3] = ctx->h[i];
+    }
+}
+
+//
+// Cache directory: <dir>/<2 hex>/<62 hex>, and <dir>/size, the size of all entries
+//
+
+// eviction goes down to 3/4 of the limit, so that the next stores don't scan again
+#define LOW_WATER(max_size) ((max_size) / 4 * 3)
+
+static char *entry_path(char *dir, uint8_t key[32], bool mkdirs) {
+    char hex[65];
+    for (int i = 0; i < 32; i++) {
+        sprintf(hex + 2 * i, "%02x", key[i]);
+    }
+
+    char *path = calloc(1, strlen(dir) + 68);
+    sprintf(path, "%s/%.2s", dir, hex);
+    if (mkdirs) {
+        mkdir(dir, 0777);
+        mkdir(path, 0777);
+    }
+    sprintf(path, "%s/%.2s/%s", dir, hex, hex + 2);
+    return path;
+}
+
+static bool read_all(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t r = read(fd, buf, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        buf += r;
+        len -= r;
+    }
+    return true;
+}
+
+static bool write_all(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t r = write(fd, buf, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        buf += r;
+        len -= r;
+    }
+    return true;
+}
+
+// return whole content of a file, NULL if missing or unreadable
+static char *slurp(char *path, size_t *len) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    char *buf = NULL;
+    if (fstat(fd, &st) == 0) {
+        buf = malloc(st.st_size + 1);
+        if (!read_all(fd, buf, st.st_size)) {
+            free(buf);
+            buf = NULL;
+        }
+        *len = st.st_size;
+    }
+    close(fd);
+    return buf;
+}
+
+/**
+ * @brief find a cached output
+ *
+ * A hit refreshes the entry's mtime, which is the recency the LRU eviction uses.
+ */
+bool cache_lookup(char *dir, uint8_t key[32], char **buf, size_t *len) {
+    char *path = entry_path(dir, key, false);
+    *buf = slurp(path, len);
+    if (*buf)
+        utimensat(AT_FDCWD, path, NULL, 0);
+    free(path);
+    return *buf != NULL;
+}
+
+typedef struct {
+    char *path;
+    off_t size;
+    struct timespec mtime;
+} Entry;
+
+static int cmp_mtime(const void *a, const void *b) {
+    const Entry *x = a, *y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec)
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    if (x->mtime.tv_nsec != y->mtime.tv_nsec)
+        return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+/**
+ * <dir>/size holds the size of all entries as one int64. Every store and eviction
+ * updates it under an exclusive flock, and nothing else adds or removes entries, so
+ * it stays exact across threads and processes. A missing or short file (a new
+ * directory, or one an older compiler filled) is rebuilt by scanning the directory.
+ */
+
+// open and lock the size file, -1 if there can't be one
+static int lock_size(char *dir) {
+    char *path = calloc(1, strlen(dir) + 6);
+    sprintf(path, "%s/size", dir);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    free(path);
+    if (fd == -1)
+        return -1;
+    int r;
+    while ((r = flock(fd, LOCK_EX)) != 0 && errno == EINTR)
+        ;
+    if (r != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief scan the directory, and if it holds more than `max_size` drop least recently
+ *        used entries until it fits in the low-water mark
+ *
+ * @param total set to the size of the entries which remain
+ * @return number of evicted entries
+ */
+static int evict(char *dir, size_t max_size, int64_t *total) {
+    Entry *entries = NULL;
+    int cnt = 0, cap = 0;
+    *total = 0;
+
+    DIR *top = opendir(dir);
+    if (!top)
+        return 0;
+    for (struct dirent *d; (d = readdir(top));) {
+        if (strlen(d->d_name) != 2)
+            continue;
+        char *sub = calloc(1, strlen(dir) + 4);
+        sprintf(sub, "%s/%s", dir, d->d_name);
+        DIR *dp = opendir(sub);
+        for (struct dirent *e; dp && (e = readdir(dp));) {
+            // skip ".", ".." and unpublished temporaries
+            if (strlen(e->d_name) != 62)
+                continue;
+            char *path = calloc(1, strlen(sub) + 64);
+            sprintf(path, "%s/%s", sub, e->d_name);
+            struct stat st;
+            if (stat(path, &st) != 0) {
+                free(path);
+                continue;
+            }
+            if (cnt == cap) {
+                cap = cap ? cap * 2 : 64;
+                entries = realloc(entries, cap * sizeof(Entry));
+            }
+            entries[cnt++] = (Entry){path, st.st_size, st.st_mtim};
+            *total += st.st_size;
+        }
+        if (dp)
+            closedir(dp);
+        free(sub);
+    }
+    closedir(top);
+
+    int evicted = 0;
+    if (*total > (int64_t)max_size) {
+        qsort(entries, cnt, sizeof(Entry), cmp_mtime);
+        for (int i = 0; i < cnt && *total > LOW_WATER(max_size); i++) {
+            if (unlink(entries[i].path) == 0) {
+                evicted++;
+                *total -= entries[i].size;
+            }
+        }
+    }
+    for (int i = 0; i < cnt; i++) {
+        free(entries[i].path);
+    }
+    free(entries);
+    return evicted;
+}
+
+/**
+ * @brief add `delta` bytes to the size held by the locked file `fd`, scan and evict
+ *        only if it exceeds `max_size`; releases the lock
+ *
+ * @return number of evicted entries
+ */
+static int account(char *dir, int fd, int64_t delta, size_t max_size) {
+    int64_t total;
+    int evicted = 0;
+    if (fd == -1 || pread(fd, &total, sizeof(total), 0) != sizeof(total) || total < 0) {
+        // the scan already counts the new entry
+        evicted = evict(dir, max_size, &total);
+    } else {
+        total += delta;
+        if (total > (int64_t)max_size)
+            evicted = evict(dir, max_size, &total);
+    }
+    if (fd != -1) {
+        // a failed write leaves a short file, which the next store rebuilds
+        if (pwrite(fd, &total, sizeof(total), 0) != sizeof(total))
+            ftruncate(fd, 0);
+        close(fd);
+    }
+    return evicted;
+}
+
+/**
+ * @brief publish an output under `key`, then trim the cache if it outgrew `max_size`
+ *
+ * The content is written to a private temporary first and renamed into
+ * place, so readers never observe a partial entry.
+ *
+ * @return number of evicted entries, -1 if the entry could not be stored
+ */
+int cache_store(char *dir, uint8_t key[32], char *buf, size_t len, size_t max_size) {
+    char *path = entry_path(dir, key, true);
+    char *tmp = calloc(1, strlen(path) + 8);
+    sprintf(tmp, "%s.XXXXXX", path);
+
+    int fd = mkstemp(tmp);
+    bool ok = fd != -1 && fchmod(fd, 0644) == 0 && write_all(fd, buf, len);
+    if (fd != -1)
+        ok = (close(fd) == 0) && ok;
+
+    // replacing an entry only changes the size by the difference, and the lock keeps
+    // another store of the same key from counting it twice
+    int lock = ok ? lock_size(dir) : -1;
+    struct stat st;
+    int64_t delta = ok && stat(path, &st) == 0 ? (int64_t)len - st.st_size : (int64_t)len;
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok && fd != -1)
+        unlink(tmp);
+    free(tmp);
+    free(path);
+
+    if (!ok) {
+        if (lock != -1)
+            close(lock);
+        return -1;
+    }
+    return account(dir, lock, delta, max_size);
+}
+
+// same as `cache_store`, but the output is a file on disk (e.g. an object file)
+int cache_store_file(char *dir, uint8_t key[32], char *file, size_t max_size) {
+    size_t len;
+    char *buf = slurp(file, &len);
+    if (!buf)
+        return -1;
+    int ret = cache_store(dir, key, buf, len, max_size);
+    free(buf);
+    return ret;
+}
@@ -20,6 +20,14 @@
 #include <stdbool.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 typedef struct Type Type;
 // type kind
@@ -30,6 +38,8 @@ typedef enum {
 
 struct Type {
     TypeKind kind;  // type kind
+    int size;       // sizeof() value
+    int align;      // alignment
     Type *base;     // if (kind == TY_PTR) current pointer point to the type of base
 };
 
@@ -59,6 +69,9 @@ struct Token {
 //
 // Parse: constructing abstract syntax tree(AST) from tokens using LL(1) and recursing down implementation
 //
+// arguments passed in registers by the System V ABI
+#define MAX_REG_ARGS 6
+
 typedef struct Node Node;
 typedef struct Variable Variable;
 typedef struct Function Function;
@@ -83,6 +96,7 @@ typedef enum {
     ND_DEREF,       // unary *
     ND_ASSIGN,      // =
     ND_NUM,         // Integer
+    ND_FUNCALL,     // function call
     /* statement */
     ND_FOR,         // for / while statement
     ND_IF,          // if statement
@@ -111,20 +125,34 @@ struct Node {
     Node *els;      // else statements
     Node *init;     // for init statement
     Node *inc;      // for increment statement
+    int prof_id;    // if / for: number in its function, names the node's profile counters
+    // function call
+    char *funcname; // callee name
+    Node *args;     // arguments, linked by `next`
 };
 
 // Variable
 struct Variable {
     char *name;     // variable name
+    Type *ty;       // variable type
     int offset;       // displacement used by stack
     Variable *next; // used by list
+    // live range in statement order, variables with disjoint ranges share a stack slot
+    int live_start;
+    int live_end;
 };
 
 // Functions
 struct Function {
+    Function *next;     // next function of the program
+    char *name;         // function name
+    Variable **params;  // parameters, also in `locals`
+    int nparams;
     Variable *locals;   // local variable
     Node *body;         // stmt body
     int stacksize;      // stack size
+    bool has_call;      // calls other functions, i.e. not a leaf
+    bool addr_taken;    // the address of some local escapes, pointers may alias the frame
 };
 
 
@@ -133,12 +161,57 @@ struct Function {
 //
 
 // key api
-Token *tokenize(char *p);
+char *read_file(char *path, size_t *len, bool *mapped);
+void free_file(char *buf, size_t len, bool mapped);
+void use_input(char *name, char *p, size_t len);
+Token *tokenize(char *name, char *p, size_t len);
 Function *parse(Token *tok);
-void codegen(Function *func);
+void codegen(Function *func, FILE *out);
+
+// pipelined compilation: functions are parsed and generated as their tokens arrive
+void tokenize_async(char *name, char *p, size_t len);
+Token *async_tokens(void);
+Token *next_token(Token *tok);
+void tokenize_async_end(void);
+void parse_start(void);
+Function *parse_toplevel(Token **rest, Token *tok);
+void codegen_start(FILE *out);
+void codegen_function(Function *func);
+void codegen_finish(void);
+bool is_vector_loop(Node *node, bool addr_taken);
+
+// streaming compilation (--stream): a function's locals are found by a prescan, then
+// each statement is read, parsed and generated before the next one, in the arena
+void tokenize_stream(char *name, char *p, size_t len);
+Token *stream_tokens(bool header);
+void stream_prescan(void (*fn)(void *ctx, Token *tok, Token *next), void *ctx);
+Function *parse_stream_function(Token *tok);
+Node *parse_stream_stmt(Token *tok);
+void parse_stream_end(Function *func);
+void codegen_function_begin(Function *func, Token *tok);
+void codegen_stmt(Node *node);
+void codegen_function_end(void);
+
+// options shared by all jobs, set by the driver before any job starts
+extern int opt_level;   // -O<n>, 0 disables optimizations
+extern bool opt_avx2;   // -mavx2: 256-bit AVX2 vectors instead of 128-bit SSE2
+extern char *opt_profile_generate;  // file the instrumented program writes its counters to
+extern char *opt_profile_use;       // profile which guides the code layout
+extern bool opt_debug;  // -g: source line info
+extern int opt_unroll;  // copies of the body of a loop with a known trip count, 1 disables unrolling
+extern int opt_constexpr_steps; // nodes a loop may evaluate while compiling, 0 disables it
 
 // utils
 void error(char *fmt, ...);
+void set_diag_output(FILE *out);
+jmp_buf *set_error_trap(jmp_buf *trap);
+jmp_buf *set_recovery_trap(jmp_buf *trap);
+char *last_error_loc(void);
+bool has_errors(void);
+char *input_filename(void);
+void line_col(char *loc, int *line, int *col);
+void set_error_limit(int limit);
+void fatal(void);
 void error_at(char *loc, char *fmt, ...);
 void error_tok(Token *tok, char *fmt, ...);
 bool equal(Token *tok, char *op);
@@ -147,6 +220,44 @@ Token *skip(Token *tok, char *s);
 // type
 extern Type *ty_int;
 bool is_integer(Node *node);
+Type *pointer_to(Type *base);
+void infer_type(Node *node);
 void add_type(Node *node);
 
+// opt: AST optimizations under -O
+void optimize(Function *func);
+
+// ast
+void emit_ast(Function *func, char *src, size_t len, FILE *out);
+Function *load_ast(char *name, char *buf, size_t len);
+
+// profile
+#define PROFILE_MAGIC "CWYJPRF1"
+void load_profile(char *path);
+bool profile_count(char *func, int id, uint64_t *count);
+
+// cache
+typedef struct {
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t buf[64];
+} Sha256;
+
+void sha256_init(Sha256 *ctx);
+void sha256_update(Sha256 *ctx, const void *data, size_t len);
+void sha256_final(Sha256 *ctx, uint8_t digest[32]);
+bool cache_lookup(char *dir, uint8_t key[32], char **buf, size_t *len);
+int cache_store(char *dir, uint8_t key[32], char *buf, size_t len, size_t max_size);
+int cache_store_file(char *dir, uint8_t key[32], char *file, size_t max_size);
+
+// arena: what lives as long as one statement of a streaming compilation
+void arena_begin(void);
+void *arena_alloc(size_t size);
+char *arena_strndup(char *s, size_t len);
+void arena_reset(void);
+void arena_end(void);
+
+// pool: run `fn(ctx, job)` for job in [0, njobs) on `nthreads` work-stealing workers
+void pool_run(int nthreads, int njobs, void (*fn)(void *ctx, int job), void *ctx);
+
 #endif
\ No newline at end of file
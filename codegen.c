@@ -11,14 +11,62 @@
 
 #include "chibicc_wyj.h"
 
+// output of current thread
+static _Thread_local FILE *output_file;
+
+// function being generated, and number of values pushed on its stack
+static _Thread_local Function *current_fn;
+static _Thread_local int depth;
+// no %rbp frame: the CFA moves with every push and pop
+static _Thread_local bool frameless;
+// last line emitted by `.loc`
+static _Thread_local int last_line;
+// next label number, restarted by every unit so its output doesn't depend on the jobs before it
+static _Thread_local int label_cnt;
+
+// System V ABI integer argument registers
+static char *argreg[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
+
 static void gen_expr(Node *node);
+static void gen_stmt(Node *node);
+
+static void println(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(output_file, fmt, ap);
+    va_end(ap);
+    fprintf(output_file, "\n");
+}
 
 static void push(void) {
-    printf("  push %%rax\n");
+    println("  push %%rax");
+    if (frameless)
+        println("  .cfi_adjust_cfa_offset 8");
+    depth++;
 }
 
 static void pop(char *arg) {
-    printf("  pop %s\n", arg);
+    println("  pop %s", arg);
+    if (frameless)
+        println("  .cfi_adjust_cfa_offset -8");
+    depth--;
+}
+
+// -g: map the following instructions to the source line of `tok`
+static void gen_loc_tok(Token *tok) {
+    if (!opt_debug || !tok)
+        return;
+    int line, col;
+    line_col(tok->loc, &line, &col);
+    if (line == last_line)
+        return;
+    println("  .loc 1 %d %d", line, col);
+    last_line = line;
+}
+
+static void gen_loc(Node *node) {
+    if (node)
+        gen_loc_tok(node->tok);
 }
 
 static void gen_addr(Node *node) {
@@ -32,22 +80,179 @@ static void gen_addr(Node *node) {
         error_tok(node->tok, "Invalid lvalue [%s:%d]", __FILE__, __LINE__);
 
     int offset = node->lvar->offset;
-    printf("  lea %d(%%rbp), %%rax\n", offset);
+    println("  lea %d(%%rbp), %%rax", offset);
+}
+
+//
+// Frame layout: variables whose live ranges don't overlap share a stack slot
+//
+
+static int align_to(int n, int align) {
+    return (n + align - 1) / align * align;
+}
+
+static void use_var(Variable *var, int pos) {
+    if (var->live_start < 0)
+        var->live_start = pos;
+    var->live_end = pos;
+}
+
+// state of the scan over a function body
+typedef struct {
+    Function *func;
+    int pos;            // position of the current statement
+    bool addr_taken;    // the address of some variable is taken
+    bool has_call;      // the function calls others
+} Scan;
+
+/**
+ * @brief number statements in execution order and record where each variable is used
+ * 
+ * A whole expression is one position, so variables used in the same statement
+ * never share a slot whatever order codegen evaluates operands in. A variable
+ * used inside a loop may carry its value across iterations, so it's live for
+ * the whole loop.
+ */
+static void scan_expr(Scan *sc, Node *node) {
+    for (; node; node = node->next) {
+        if (node->kind == ND_VAR)
+            use_var(node->lvar, sc->pos);
+        if (node->kind == ND_ADDR)
+            sc->addr_taken = true;
+        if (node->kind == ND_FUNCALL)
+            sc->has_call = true;
+        scan_expr(sc, node->lhs);
+        scan_expr(sc, node->rhs);
+        scan_expr(sc, node->args);
+    }
 }
 
-// calculate offset of local variables
-static void gen_lvar_offset(Function *func) {
+static void scan_stmt(Scan *sc, Node *node) {
+    for (; node; node = node->next) {
+        switch (node->kind) {
+        case ND_BLOCK:
+            scan_stmt(sc, node->body);
+            break;
+        case ND_IF:
+            scan_expr(sc, node->cond);
+            sc->pos++;
+            scan_stmt(sc, node->then);
+            scan_stmt(sc, node->els);
+            break;
+        case ND_FOR: {
+            scan_stmt(sc, node->init);
+            int begin = sc->pos;
+            scan_expr(sc, node->cond);
+            sc->pos++;
+            scan_stmt(sc, node->then);
+            scan_expr(sc, node->inc);
+            int end = sc->pos++;
+            for (Variable *var = sc->func->locals; var; var = var->next) {
+                if (var->live_end >= begin) {
+                    if (var->live_start > begin)
+                        var->live_start = begin;
+                    var->live_end = end;
+                }
+            }
+            break;
+        }
+        default:
+            scan_expr(sc, node->lhs);
+            sc->pos++;
+            break;
+        }
+    }
+}
+
+// one slot per variable in list order, e.g. when `&x + 1` may reach the next variable
+static void assign_fixed_offsets(Function *func) {
     int offset = 0;
-    for (Variable *pv=func->locals; pv; pv=pv->next) {
-        offset += 8;
-        pv->offset -= offset;
+    for (Variable *var = func->locals; var; var = var->next) {
+        offset = align_to(offset + var->ty->size, var->ty->align);
+        var->offset = -offset;
     }
-    func->stacksize = offset;
+    func->stacksize = align_to(offset, 16);
+}
+
+static int cmp_live_start(const void *a, const void *b) {
+    Variable *x = *(Variable **)a, *y = *(Variable **)b;
+    return x->live_start - y->live_start;
+}
+
+// stack slot, may be shared by several variables over time
+typedef struct {
+    int offset;
+    int size;
+    int busy_until;     // live_end of the last variable using it
+} Slot;
+
+/**
+ * @brief assign stack offsets to local variables
+ * 
+ * Linear scan over live ranges: variables sorted by start take a free slot of
+ * the same size (freed once its last user's range is over), or open a new
+ * naturally aligned slot. Taking an address (`&x + 1`) may reach neighbouring
+ * variables, so such functions keep one slot per variable in declaration order.
+ * The frame is rounded up to 16 bytes to keep %rsp aligned as the ABI needs.
+ * Also record whether the function calls others.
+ */
+static void assign_lvar_offsets(Function *func) {
+    int nvars = 0;
+    for (Variable *var = func->locals; var; var = var->next) {
+        var->live_start = -1;
+        var->live_end = -1;
+        nvars++;
+    }
+
+    // parameters are stored by the prologue, at position 0
+    for (int i = 0; i < func->nparams; i++) {
+        use_var(func->params[i], 0);
+    }
+    Scan sc = {func, 1};
+    scan_stmt(&sc, func->body);
+    func->has_call = sc.has_call;
+    func->addr_taken = sc.addr_taken;
+
+    if (sc.addr_taken) {
+        assign_fixed_offsets(func);
+        return;
+    }
+
+    int offset = 0;
+    Variable **vars = calloc(nvars, sizeof(Variable *));
+    int i = 0;
+    for (Variable *var = func->locals; var; var = var->next) {
+        vars[i++] = var;
+    }
+    qsort(vars, nvars, sizeof(Variable *), cmp_live_start);
+
+    Slot *slots = calloc(nvars, sizeof(Slot));
+    int nslots = 0;
+    for (i = 0; i < nvars; i++) {
+        Variable *var = vars[i];
+        Slot *slot = NULL;
+        for (int j = 0; j < nslots && !slot; j++) {
+            if (slots[j].busy_until < var->live_start && slots[j].size == var->ty->size &&
+                slots[j].offset % var->ty->align == 0)
+                slot = &slots[j];
+        }
+        if (!slot) {
+            offset = align_to(offset + var->ty->size, var->ty->align);
+            slot = &slots[nslots++];
+            slot->offset = -offset;
+            slot->size = var->ty->size;
+        }
+        slot->busy_until = var->live_end;
+        var->offset = slot->offset;
+    }
+    func->stacksize = align_to(offset, 16);
+
+    free(slots);
+    free(vars);
 }
 
 static int label_count() {
-    static int cnt = 0;
-    return cnt++;
+    return label_cnt++;
 }
 
 static void gen_expr(Node *node) {
@@ -58,23 +263,45 @@ static void gen_expr(Node *node) {
     switch (node->kind)
     {
         case ND_NUM:
-            printf("  mov $%d, %%rax\n", node->value);
+            println("  mov $%d, %%rax", node->value);
             return;
         case ND_NEG:
             gen_expr(node->lhs);
-            printf("  neg %%rax\n");
+            println("  neg %%rax");
             return;
         case ND_ADDR:
             gen_addr(node->lhs);
             return;
         case ND_DEREF:
             gen_addr(node);
-            printf("  mov (%%rax), %%rax\n");
+            println("  mov (%%rax), %%rax");
             return;
         case ND_VAR:
             gen_addr(node);
-            printf("  mov (%%rax), %%rax\n");
+            println("  mov (%%rax), %%rax");
             return;
+        case ND_FUNCALL: {
+            int nargs = 0;
+            for (Node *arg = node->args; arg; arg = arg->next) {
+                gen_expr(arg);
+                push();
+                nargs++;
+            }
+            for (int i = nargs - 1; i >= 0; i--) {
+                pop(argreg[i]);
+            }
+
+            // %rsp must be 16-byte aligned at the call, the frame itself is
+            println("  mov $0, %%rax");
+            if (depth % 2) {
+                println("  sub $8, %%rsp");
+                println("  call %s", node->funcname);
+                println("  add $8, %%rsp");
+            } else {
+                println("  call %s", node->funcname);
+            }
+            return;
+        }
         case ND_ASSIGN:
             // Firstly, using %eax to push all left variable address into stack, then %eax only save the rightmost number value
             // e.g. a=b=c=3 => (1) push a; push b; push c; (2) %rax=3, %rdi=c; %rax=3, %rdi=b; %rax=3, %rdi=a
@@ -82,7 +309,7 @@ static void gen_expr(Node *node) {
             push();
             gen_expr(node->rhs);
             pop("%rdi");
-            printf("  mov %%rax, (%%rdi)\n");
+            println("  mov %%rax, (%%rdi)");
             return;
     }
 
@@ -96,17 +323,17 @@ static void gen_expr(Node *node) {
     {
         /* arithmetic operators */
         case ND_ADD:
-            printf("  add %%rdi, %%rax\n");
+            println("  add %%rdi, %%rax");
             break;
         case ND_SUB:
-            printf("  sub %%rdi, %%rax\n");
+            println("  sub %%rdi, %%rax");
             break;
         case ND_MUL:
-            printf("  imul %%rdi, %%rax\n");
+            println("  imul %%rdi, %%rax");
             break;
         case ND_DIV:
-            printf("  cqo\n");  // RDX:RAX:= sign-extend of RAX
-            printf("  idiv %%rdi\n");
+            println("  cqo");  // RDX:RAX:= sign-extend of RAX
+            println("  idiv %%rdi");
             break;
 
         /* comparison operators */
@@ -116,9 +343,9 @@ static void gen_expr(Node *node) {
         case ND_LE:
         case ND_GT:
         case ND_GE:
-            printf("  cmp %%rdi, %%rax\n");     // rax - rdi
-            printf("  %s %%al\n", CMP_ASM_NAME(node->kind));
-            printf("  movzb %%al, %%rax\n");    // zero extend
+            println("  cmp %%rdi, %%rax");     // rax - rdi
+            println("  %s %%al", CMP_ASM_NAME(node->kind));
+            println("  movzb %%al, %%rax");    // zero extend
             break;
         
         /* error handle */
@@ -129,7 +356,548 @@ static void gen_expr(Node *node) {
     return;
 }
 
+//
+// Vectorization of simple counted loops:
+//   for (i = ...; i < n; i = i + 1) { *(c + i*8) = *(a + i*8) + *(b + i*8) - k; ... }
+// every statement stores through `base + i*8` a value built from such loads, loop
+// invariant variables and numbers with + and -. One vector iteration runs VL
+// scalar iterations, VL = 2 with SSE2 or 4 with AVX2; the original loop then runs
+// what is left over, and also everything when the runtime alias check fails.
+//
+
+#define MAX_VEC_BASES 16
+#define NUM_VEC_REGS 16
+
+typedef struct {
+    Variable *iv;       // induction variable `i`
+    Node *bound;        // `n`
+    bool inclusive;     // i <= n
+    Variable *bases[MAX_VEC_BASES];
+    bool stored[MAX_VEC_BASES];
+    int nbases;
+} VecLoop;
+
+static bool is_var(Node *node, Variable *var) {
+    return node->kind == ND_VAR && node->lvar == var;
+}
+
+// a variable which the loop never writes
+static bool is_invariant(VecLoop *lp, Node *node) {
+    return node->kind == ND_NUM || (node->kind == ND_VAR && node->lvar != lp->iv);
+}
+
+// `base + i*8`, `base + 8*i`, `i*8 + base`... => index of `base` in lp->bases, -1 if no match
+static int vec_base(VecLoop *lp, Node *addr, bool store) {
+    if (addr->kind != ND_ADD)
+        return -1;
+    Node *base = addr->lhs, *idx = addr->rhs;
+    if (base->kind == ND_MUL) {
+        base = addr->rhs;
+        idx = addr->lhs;
+    }
+    if (base->kind != ND_VAR || base->lvar == lp->iv || idx->kind != ND_MUL)
+        return -1;
+    if (!(is_var(idx->lhs, lp->iv) && idx->rhs->kind == ND_NUM && idx->rhs->value == 8) &&
+        !(is_var(idx->rhs, lp->iv) && idx->lhs->kind == ND_NUM && idx->lhs->value == 8))
+        return -1;
+
+    int i = 0;
+    while (i < lp->nbases && lp->bases[i] != base->lvar)
+        i++;
+    if (i == MAX_VEC_BASES)
+        return -1;
+    if (i == lp->nbases)
+        lp->bases[lp->nbases++] = base->lvar;
+    lp->stored[i] |= store;
+    return i;
+}
+
+// can `node` be evaluated into vector register `reg`
+static bool vec_expr_ok(VecLoop *lp, Node *node, int reg) {
+    if (reg >= NUM_VEC_REGS)
+        return false;
+    switch (node->kind) {
+    case ND_NUM:
+    case ND_VAR:
+        return is_invariant(lp, node);
+    case ND_DEREF:
+        return vec_base(lp, node->lhs, false) != -1;
+    case ND_NEG:
+        return vec_expr_ok(lp, node->lhs, reg + 1);
+    case ND_ADD:
+    case ND_SUB:
+        return vec_expr_ok(lp, node->lhs, reg) && vec_expr_ok(lp, node->rhs, reg + 1);
+    default:
+        return false;
+    }
+}
+
+// `*(base + i*8) = expr;`
+static bool vec_stmt_ok(VecLoop *lp, Node *node) {
+    if (node->kind != ND_EXPR_STMT || node->lhs->kind != ND_ASSIGN)
+        return false;
+    Node *assign = node->lhs;
+    return assign->lhs->kind == ND_DEREF && vec_base(lp, assign->lhs->lhs, true) != -1 &&
+           vec_expr_ok(lp, assign->rhs, 0);
+}
+
+/**
+ * @brief recognize a countable loop without loop-carried dependences
+ * 
+ * The body may only write memory through `base + i*8`, so `i`, `n` and the
+ * bases are loop invariant as long as no pointer can reach the frame, i.e.
+ * no local has its address taken.
+ */
+static bool vec_loop_ok(VecLoop *lp, Node *node, bool addr_taken) {
+    if (addr_taken || !node->cond || !node->inc)
+        return false;
+
+    // i < n, i <= n
+    Node *cond = node->cond;
+    if ((cond->kind != ND_LT && cond->kind != ND_LE) || cond->lhs->kind != ND_VAR)
+        return false;
+    lp->iv = cond->lhs->lvar;
+    lp->bound = cond->rhs;
+    lp->inclusive = cond->kind == ND_LE;
+    if (!is_invariant(lp, lp->bound))
+        return false;
+
+    // i = i + 1
+    Node *inc = node->inc;
+    if (inc->kind != ND_ASSIGN || !is_var(inc->lhs, lp->iv) || inc->rhs->kind != ND_ADD)
+        return false;
+    Node *add = inc->rhs;
+    if (!(is_var(add->lhs, lp->iv) && add->rhs->kind == ND_NUM && add->rhs->value == 1) &&
+        !(is_var(add->rhs, lp->iv) && add->lhs->kind == ND_NUM && add->lhs->value == 1))
+        return false;
+
+    Node *body = node->then->kind == ND_BLOCK ? node->then->body : node->then;
+    if (!body)
+        return false;
+    for (Node *n = body; n; n = n->next) {
+        if (!vec_stmt_ok(lp, n))
+            return false;
+        if (node->then->kind != ND_BLOCK)
+            break;
+    }
+    return true;
+}
+
+// whether codegen turns the ND_FOR `node` into a vector loop, for passes which must leave it alone
+bool is_vector_loop(Node *node, bool addr_taken) {
+    VecLoop lp = {};
+    return opt_level > 0 && !opt_profile_generate && vec_loop_ok(&lp, node, addr_taken);
+}
+
+// evaluate `node` into vector register `reg`, %rcx holds `i`
+static void gen_vec_expr(Node *node, int reg) {
+    switch (node->kind) {
+    case ND_NUM:
+        println("  mov $%d, %%rax", node->value);
+        if (opt_avx2) {
+            println("  vmovq %%rax, %%xmm%d", reg);
+            println("  vpbroadcastq %%xmm%d, %%ymm%d", reg, reg);
+        } else {
+            println("  movq %%rax, %%xmm%d", reg);
+            println("  punpcklqdq %%xmm%d, %%xmm%d", reg, reg);
+        }
+        return;
+    case ND_VAR:
+        if (opt_avx2) {
+            println("  vpbroadcastq %d(%%rbp), %%ymm%d", node->lvar->offset, reg);
+        } else {
+            println("  movq %d(%%rbp), %%xmm%d", node->lvar->offset, reg);
+            println("  punpcklqdq %%xmm%d, %%xmm%d", reg, reg);
+        }
+        return;
+    case ND_DEREF: {
+        Node *addr = node->lhs;
+        Node *base = addr->lhs->kind == ND_VAR ? addr->lhs : addr->rhs;
+        println("  mov %d(%%rbp), %%rax", base->lvar->offset);
+        if (opt_avx2)
+            println("  vmovdqu (%%rax,%%rcx,8), %%ymm%d", reg);
+        else
+            println("  movdqu (%%rax,%%rcx,8), %%xmm%d", reg);
+        return;
+    }
+    case ND_NEG:
+        gen_vec_expr(node->lhs, reg + 1);
+        if (opt_avx2) {
+            println("  vpxor %%ymm%d, %%ymm%d, %%ymm%d", reg, reg, reg);
+            println("  vpsubq %%ymm%d, %%ymm%d, %%ymm%d", reg + 1, reg, reg);
+        } else {
+            println("  pxor %%xmm%d, %%xmm%d", reg, reg);
+            println("  psubq %%xmm%d, %%xmm%d", reg + 1, reg);
+        }
+        return;
+    default: {
+        char *op = node->kind == ND_ADD ? "paddq" : "psubq";
+        gen_vec_expr(node->lhs, reg);
+        gen_vec_expr(node->rhs, reg + 1);
+        if (opt_avx2)
+            println("  v%s %%ymm%d, %%ymm%d, %%ymm%d", op, reg + 1, reg, reg);
+        else
+            println("  %s %%xmm%d, %%xmm%d", op, reg + 1, reg);
+        return;
+    }
+    }
+}
+
+/**
+ * @brief emit the vector loop in front of the scalar loop labeled `lcnt`
+ * 
+ * Loads and stores use the same index, so bases which are equal, or at least
+ * one vector apart, can't see a value the scalar loop wouldn't have seen. If
+ * any stored base is closer to another base than that, jump straight to the
+ * scalar loop.
+ */
+static void gen_vector_loop(Node *node, int lcnt) {
+    VecLoop lp = {};
+    if (!vec_loop_ok(&lp, node, current_fn->addr_taken))
+        return;
+    int vl = opt_avx2 ? 4 : 2;
+
+    // %rdx = first `i` which must not run: n, or n + 1 for `i <= n`
+    gen_expr(lp.bound);
+    if (lp.inclusive)
+        println("  add $1, %%rax");
+    println("  mov %%rax, %%rdx");
+
+    // runtime alias check: a == b or |a - b| >= vl * 8, i.e. not 0 < |a - b| < vl * 8
+    for (int i = 0; i < lp.nbases; i++) {
+        for (int j = i + 1; j < lp.nbases; j++) {
+            if (!lp.stored[i] && !lp.stored[j])
+                continue;
+            println("  mov %d(%%rbp), %%rax", lp.bases[i]->offset);
+            println("  sub %d(%%rbp), %%rax", lp.bases[j]->offset);
+            println("  mov %%rax, %%rdi");
+            println("  neg %%rax");
+            println("  cmovl %%rdi, %%rax");
+            // unsigned: |a - b| - 1 wraps around when the bases are equal
+            println("  sub $1, %%rax");
+            println("  cmp $%d, %%rax", vl * 8 - 1);
+            println("  jb .L.BEGIN.%d", lcnt);
+        }
+    }
+
+    println("  mov %d(%%rbp), %%rcx", lp.iv->offset);
+    println(".L.VBEGIN.%d:", lcnt);
+    println("  lea %d(%%rcx), %%rax", vl);
+    println("  cmp %%rdx, %%rax");
+    println("  jg .L.VEND.%d", lcnt);
+    Node *body = node->then->kind == ND_BLOCK ? node->then->body : node->then;
+    for (Node *n = body; n; n = n->next) {
+        Node *assign = n->lhs;
+        gen_vec_expr(assign->rhs, 0);
+        Node *addr = assign->lhs->lhs;
+        Node *base = addr->lhs->kind == ND_VAR ? addr->lhs : addr->rhs;
+        println("  mov %d(%%rbp), %%rax", base->lvar->offset);
+        if (opt_avx2)
+            println("  vmovdqu %%ymm0, (%%rax,%%rcx,8)");
+        else
+            println("  movdqu %%xmm0, (%%rax,%%rcx,8)");
+        if (node->then->kind != ND_BLOCK)
+            break;
+    }
+    println("  add $%d, %%rcx", vl);
+    println("  jmp .L.VBEGIN.%d", lcnt);
+    println(".L.VEND.%d:", lcnt);
+    println("  mov %%rcx, %d(%%rbp)", lp.iv->offset);
+    // avoid the AVX => SSE transition penalty in the code that follows
+    if (opt_avx2)
+        println("  vzeroupper");
+}
+
+//
+// Profile-guided optimization:
+//   -fprofile-generate counts how often each if branch runs and how often each loop
+//   is entered and goes around, the program appends its counters to the profile at exit;
+//   -fprofile-use lays hot branches out as fall-through, moves cold ones after the
+//   function's `ret`, and unrolls loops which run many iterations per entry
+//
+
+// a branch taken at most 1/COLD_RATIO as often as the other one is cold
+#define COLD_RATIO 8
+// loops averaging at least HOT_TRIP_COUNT iterations per entry are unrolled PGO_UNROLL times
+#define HOT_TRIP_COUNT 4
+#define PGO_UNROLL 4
+
+// counters of this unit
+typedef struct {
+    char *func;
+    int id;
+} ProfCounter;
+
+static _Thread_local ProfCounter *counters;
+static _Thread_local int ncounters;
+static _Thread_local int cap_counters;
+
+// blocks which go out of line, after the current function's `ret`
+typedef struct {
+    Node *stmt;
+    char *label;
+    int lcnt;
+} ColdBlock;
+
+static _Thread_local ColdBlock *cold_blocks;
+static _Thread_local int ncold;
+static _Thread_local int cap_cold;
+
+/**
+ * @brief number if / for statements in source order
+ * 
+ * Statement `n` owns counters 2n (then branch / loop entry) and 2n+1 (else branch /
+ * loop back edge). The numbering doesn't depend on code layout, so the instrumented
+ * and the optimized build agree on it.
+ */
+static void number_branches(Node *node, int *cnt) {
+    for (; node; node = node->next) {
+        switch (node->kind) {
+        case ND_BLOCK:
+            number_branches(node->body, cnt);
+            break;
+        case ND_IF:
+            node->prof_id = (*cnt)++;
+            number_branches(node->then, cnt);
+            number_branches(node->els, cnt);
+            break;
+        case ND_FOR:
+            node->prof_id = (*cnt)++;
+            number_branches(node->then, cnt);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+// -fprofile-generate: count one more execution of counter `id` of the current function
+static void gen_counter(int id) {
+    if (ncounters == cap_counters) {
+        cap_counters = cap_counters ? cap_counters * 2 : 64;
+        counters = realloc(counters, cap_counters * sizeof(ProfCounter));
+    }
+    counters[ncounters] = (ProfCounter){current_fn->name, id};
+    println("  incq .L.PROF.%d(%%rip)", ncounters++);
+}
+
+// -fprofile-use: counts of both counters of `node`, false if the profile never saw it run
+static bool branch_counts(Node *node, uint64_t *first, uint64_t *second) {
+    return opt_profile_use &&
+           profile_count(current_fn->name, 2 * node->prof_id, first) &&
+           profile_count(current_fn->name, 2 * node->prof_id + 1, second) &&
+           *first + *second > 0;
+}
+
+static void defer_cold(Node *stmt, char *label, int lcnt) {
+    if (ncold == cap_cold) {
+        cap_cold = cap_cold ? cap_cold * 2 : 16;
+        cold_blocks = realloc(cold_blocks, cap_cold * sizeof(ColdBlock));
+    }
+    cold_blocks[ncold++] = (ColdBlock){stmt, label, lcnt};
+}
+
+static void print_asciz(char *str) {
+    fprintf(output_file, "  .asciz \"");
+    for (char *p = str; *p; p++) {
+        if (*p == '"' || *p == '\\')
+            fprintf(output_file, "\\%c", *p);
+        else if (isprint((unsigned char)*p))
+            fputc(*p, output_file);
+        else
+            fprintf(output_file, "\\%03o", (unsigned char)*p);
+    }
+    fprintf(output_file, "\"\n");
+}
+
+/**
+ * @brief emit the counters of this unit in the profile format, and a .fini_array
+ * entry which appends them to the profile at exit
+ * 
+ * The dump uses raw system calls, so instrumented code needs nothing from libc.
+ */
+static void gen_profile_dump(void) {
+    println("  .data");
+    println("  .balign 8");
+    println(".L.PROF.DATA:");
+    println("  .ascii \"%s\"", PROFILE_MAGIC);
+    println("  .quad .L.PROF.END - .L.PROF.DATA");
+    for (int i = 0; i < ncounters; i++) {
+        println(".L.PROF.%d:", i);
+        println("  .quad 0");
+        println("  .quad %d", counters[i].id);
+        print_asciz(counters[i].func);
+        println("  .balign 8");
+    }
+    println(".L.PROF.END:");
+    println(".L.PROF.PATH:");
+    print_asciz(opt_profile_generate);
+
+    // fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644); write(fd, data, len); close(fd)
+    println("  .text");
+    println(".L.PROF.DUMP:");
+    println("  .cfi_startproc");
+    println("  mov $2, %%rax");
+    println("  lea .L.PROF.PATH(%%rip), %%rdi");
+    println("  mov $%d, %%rsi", 01 | 0100 | 02000);
+    println("  mov $%d, %%rdx", 0644);
+    println("  syscall");
+    println("  test %%rax, %%rax");
+    println("  js .L.PROF.RET");
+    println("  mov %%rax, %%rdi");
+    println("  mov $1, %%rax");
+    println("  lea .L.PROF.DATA(%%rip), %%rsi");
+    println("  mov $(.L.PROF.END - .L.PROF.DATA), %%rdx");
+    println("  syscall");
+    println("  mov $3, %%rax");
+    println("  syscall");
+    println(".L.PROF.RET:");
+    println("  ret");
+    println("  .cfi_endproc");
+
+    println("  .section .fini_array, \"aw\"");
+    println("  .balign 8");
+    println("  .quad .L.PROF.DUMP");
+}
+
+//
+// Unrolling of loops with a known trip count (-O, -funroll-factor=<n>)
+//
+
+// constant value of `node`: a number, or a negated one
+static bool const_value(Node *node, int64_t *val) {
+    if (node->kind == ND_NEG && node->lhs->kind == ND_NUM) {
+        *val = -(int64_t)node->lhs->value;
+        return true;
+    }
+    if (node->kind == ND_NUM) {
+        *val = node->value;
+        return true;
+    }
+    return false;
+}
+
+// whether `node` assigns to `var`
+static bool assigns(Node *node, Variable *var) {
+    for (; node; node = node->next) {
+        if (node->kind == ND_ASSIGN && node->lhs->kind == ND_VAR && node->lhs->lvar == var)
+            return true;
+        if (assigns(node->lhs, var) || assigns(node->rhs, var) || assigns(node->body, var) ||
+            assigns(node->cond, var) || assigns(node->then, var) || assigns(node->els, var) ||
+            assigns(node->init, var) || assigns(node->inc, var) || assigns(node->args, var))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief trip count of `for (i = a; i < b; i = i + c)` with constant a, b and c
+ * 
+ * The condition may also be `<=`, `>` or `>=`, the increment `i = i - c`. The
+ * body must not assign `i`, and no pointer may reach the frame, so `i` changes
+ * by the increment only.
+ */
+static bool trip_count(Node *node, int64_t *trips) {
+    if (current_fn->addr_taken || !node->init || node->init->kind != ND_EXPR_STMT ||
+        !node->cond || !node->inc)
+        return false;
+
+    // i = a
+    Node *init = node->init->lhs;
+    int64_t from, to, step;
+    if (init->kind != ND_ASSIGN || init->lhs->kind != ND_VAR || !const_value(init->rhs, &from))
+        return false;
+    Variable *iv = init->lhs->lvar;
+
+    // i = i + c, i = c + i, i = i - c
+    Node *inc = node->inc;
+    if (inc->kind != ND_ASSIGN || !is_var(inc->lhs, iv))
+        return false;
+    Node *rhs = inc->rhs;
+    Node *c = NULL;
+    if ((rhs->kind == ND_ADD || rhs->kind == ND_SUB) && is_var(rhs->lhs, iv))
+        c = rhs->rhs;
+    else if (rhs->kind == ND_ADD && is_var(rhs->rhs, iv))
+        c = rhs->lhs;
+    if (!c || !const_value(c, &step))
+        return false;
+    if (rhs->kind == ND_SUB)
+        step = -step;
+
+    // i < b, i <= b, i > b, i >= b
+    Node *cond = node->cond;
+    if ((cond->kind != ND_LT && cond->kind != ND_LE && cond->kind != ND_GT && cond->kind != ND_GE) ||
+        !is_var(cond->lhs, iv) || !const_value(cond->rhs, &to))
+        return false;
+    if (assigns(node->then, iv) || assigns(cond, iv))
+        return false;
+
+    switch (cond->kind) {
+    case ND_LE:
+        to++;
+        // fallthrough
+    case ND_LT:
+        if (from >= to) {
+            *trips = 0;
+            return true;
+        }
+        if (step <= 0)
+            return false;
+        *trips = (to - from + step - 1) / step;
+        return true;
+    case ND_GE:
+        to--;
+        // fallthrough
+    case ND_GT:
+        if (from <= to) {
+            *trips = 0;
+            return true;
+        }
+        if (step >= 0)
+            return false;
+        *trips = (from - to - step - 1) / -step;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void gen_iteration(Node *node) {
+    gen_stmt(node->then);
+    gen_loc(node->inc);
+    gen_expr(node->inc);
+}
+
+/**
+ * @brief emit a loop which runs `trips` iterations, init has been generated
+ * 
+ * Up to opt_unroll iterations are generated straight. Otherwise the remainder
+ * iterations come first, then a loop of opt_unroll copies of the body which
+ * checks the condition once per copies, at the bottom: the remainder leaves a
+ * multiple of opt_unroll iterations, so the check can't fall in between.
+ */
+static void gen_unrolled_loop(Node *node, int64_t trips, int lcnt) {
+    int64_t straight = trips <= opt_unroll ? trips : trips % opt_unroll;
+    for (int64_t i = 0; i < straight; i++) {
+        gen_iteration(node);
+    }
+    if (straight == trips)
+        return;
+
+    println(".L.BEGIN.%d:", lcnt);
+    for (int i = 0; i < opt_unroll; i++) {
+        gen_iteration(node);
+    }
+    gen_loc(node->cond);
+    gen_expr(node->cond);
+    println("  cmp $0, %%rax");
+    println("  jne .L.BEGIN.%d", lcnt);
+}
+
 static void gen_stmt(Node *node) {
+    if (node->kind != ND_BLOCK)
+        gen_loc(node);
+
     if (node->kind == ND_EXPR_STMT) {
         gen_expr(node->lhs);
         return;
@@ -137,7 +905,7 @@ static void gen_stmt(Node *node) {
 
     if (node->kind == ND_RETURN) {
         gen_expr(node->lhs);
-        printf("  jmp .L.RETURN\n");
+        println("  jmp .L.RETURN.%s", current_fn->name);
         return;
     }
 
@@ -150,16 +918,51 @@ static void gen_stmt(Node *node) {
 
     if (node->kind == ND_IF) {
         int lcnt = label_count();
+        uint64_t then_cnt, else_cnt;
+        bool profiled = branch_counts(node, &then_cnt, &else_cnt);
         gen_expr(node->cond);
-        printf("  cmp $0, %%rax\n");
-        printf("  je .L.ELSE.%d\n", lcnt);
+        println("  cmp $0, %%rax");
+
+        // cold then: out of line, else falls through
+        if (profiled && then_cnt * COLD_RATIO <= else_cnt) {
+            println("  jne .L.THEN.%d", lcnt);
+            defer_cold(node->then, "THEN", lcnt);
+            if (node->els)
+                gen_stmt(node->els);
+            println(".L.END.%d:", lcnt);
+            return;
+        }
+        // cold else: out of line, then falls through
+        if (profiled && node->els && else_cnt * COLD_RATIO <= then_cnt) {
+            println("  je .L.ELSE.%d", lcnt);
+            defer_cold(node->els, "ELSE", lcnt);
+            gen_stmt(node->then);
+            println(".L.END.%d:", lcnt);
+            return;
+        }
+        // else is the hotter one, let it fall through
+        if (profiled && node->els && else_cnt > then_cnt) {
+            println("  jne .L.THEN.%d", lcnt);
+            gen_stmt(node->els);
+            println("  jmp .L.END.%d", lcnt);
+            println(".L.THEN.%d:", lcnt);
+            gen_stmt(node->then);
+            println(".L.END.%d:", lcnt);
+            return;
+        }
+
+        println("  je .L.ELSE.%d", lcnt);
+        if (opt_profile_generate)
+            gen_counter(2 * node->prof_id);
         gen_stmt(node->then);
-        printf("  jmp .L.END.%d\n", lcnt);
-        printf(".L.ELSE.%d:\n", lcnt);
+        println("  jmp .L.END.%d", lcnt);
+        println(".L.ELSE.%d:", lcnt);
+        if (opt_profile_generate)
+            gen_counter(2 * node->prof_id + 1);
         if (node->els) {
             gen_stmt(node->els);
         }
-        printf(".L.END.%d:\n", lcnt);
+        println(".L.END.%d:", lcnt);
         return;
     }
 
@@ -168,45 +971,193 @@ static void gen_stmt(Node *node) {
         int lcnt = label_count();
         if (node->init != NULL)
             gen_stmt(node->init);
+        if (opt_profile_generate)
+            gen_counter(2 * node->prof_id);
+        // whole vectors first, the scalar loop below finishes the rest;
+        // an instrumented loop stays scalar to count every iteration
+        bool vectorized = is_vector_loop(node, current_fn->addr_taken);
+        if (vectorized)
+            gen_vector_loop(node, lcnt);
 
-        printf(".L.BEGIN.%d:\n", lcnt);
-        // consider condition is null / not null, this why the condition don't use `expr_stmt` directly.
-        // "for" "(" expr_stmt expr?; expr? ")" stmt
-        if (node->cond != NULL) {
-            gen_expr(node->cond);
-            printf("  cmp $0, %%rax\n");
-            printf("  je .L.END.%d\n", lcnt);
+        // the vector loop leaves an unknown number of iterations
+        int64_t trips;
+        if (opt_level > 0 && opt_unroll > 1 && !opt_profile_generate && !vectorized &&
+            trip_count(node, &trips)) {
+            gen_unrolled_loop(node, trips, lcnt);
+            return;
         }
 
-        gen_stmt(node->then);
-        
-        if (node->inc != NULL)
-            gen_expr(node->inc);
-        
-        printf("  jmp .L.BEGIN.%d\n", lcnt);
-        printf(".L.END.%d:\n", lcnt);
+        // a hot loop checks its condition between copies of the body, but jumps back once per copies
+        uint64_t entries, iters;
+        int copies = 1;
+        if (branch_counts(node, &entries, &iters) && iters >= entries * HOT_TRIP_COUNT)
+            copies = PGO_UNROLL;
+
+        println(".L.BEGIN.%d:", lcnt);
+        for (int i = 0; i < copies; i++) {
+            // consider condition is null / not null, this why the condition don't use `expr_stmt` directly.
+            // "for" "(" expr_stmt expr?; expr? ")" stmt
+            if (node->cond != NULL) {
+                gen_loc(node->cond);
+                gen_expr(node->cond);
+                println("  cmp $0, %%rax");
+                println("  je .L.END.%d", lcnt);
+            }
+
+            gen_stmt(node->then);
+
+            if (node->inc != NULL) {
+                gen_loc(node->inc);
+                gen_expr(node->inc);
+            }
+        }
+
+        if (opt_profile_generate)
+            gen_counter(2 * node->prof_id + 1);
+        println("  jmp .L.BEGIN.%d", lcnt);
+        println(".L.END.%d:", lcnt);
         return;
     }
 
     error_tok(node->tok, "Invalid statement: node->kind=%d [%s:%d]", node->kind, __FILE__, __LINE__);
 }
 
-void codegen(Function *func) {
-    gen_lvar_offset(func);
+/**
+ * @brief generate one function
+ * 
+ * A leaf function without stack slots doesn't need %rbp, so it gets no
+ * prologue/epilogue at all: its pushes and pops are balanced and it calls
+ * nobody, so %rsp alignment doesn't matter either.
+ * 
+ * CFI describes how to find the caller's frame at every instruction: the CFA
+ * is %rbp + 16 once the frame is set up, or %rsp + 8 + pushes without a frame.
+ */
+static void gen_prologue(Function *func, Token *tok) {
+    frameless = !func->has_call && func->stacksize == 0;
 
-    printf("  .global main\n");
-    printf("main:\n");
+    println("  .global %s", func->name);
+    println("  .text");
+    println("  .type %s, @function", func->name);
+    println("%s:", func->name);
+    println("  .cfi_startproc");
+    gen_loc_tok(tok);
 
     // allocate stack for local variables
-    printf("  push %%rbp\n");
-    printf("  mov %%rsp, %%rbp\n");
-    printf("  sub $%d, %%rsp\n", func->stacksize);
+    if (!frameless) {
+        println("  push %%rbp");
+        println("  .cfi_def_cfa_offset 16");
+        println("  .cfi_offset %%rbp, -16");
+        println("  mov %%rsp, %%rbp");
+        println("  .cfi_def_cfa_register %%rbp");
+        if (func->stacksize)
+            println("  sub $%d, %%rsp", func->stacksize);
+    }
+
+    // register arguments => parameter slots
+    for (int i = 0; i < func->nparams; i++) {
+        println("  mov %s, %d(%%rbp)", argreg[i], func->params[i]->offset);
+    }
+}
+
+static void gen_epilogue(Function *func) {
+    // restore stack, cold blocks after `ret` still run inside the frame
+    println(".L.RETURN.%s:", func->name);
+    println("  .cfi_remember_state");
+    if (!frameless) {
+        println("  mov %%rbp, %%rsp");
+        println("  pop %%rbp");
+        println("  .cfi_def_cfa %%rsp, 8");
+    }
+    println("  ret");
+    println("  .cfi_restore_state");
+
+    // cold blocks may defer more cold blocks
+    for (int i = 0; i < ncold; i++) {
+        ColdBlock cb = cold_blocks[i];
+        println(".L.%s.%d:", cb.label, cb.lcnt);
+        gen_stmt(cb.stmt);
+        println("  jmp .L.END.%d", cb.lcnt);
+    }
+    println("  .cfi_endproc");
+    println("  .size %s, .-%s", func->name, func->name);
+}
 
+static void gen_function(Function *func) {
+    current_fn = func;
+    depth = 0;
+    ncold = 0;
+    last_line = 0;
+    assign_lvar_offsets(func);
+    int nbranches = 0;
+    number_branches(func->body, &nbranches);
+
+    gen_prologue(func, func->body->tok);
     gen_stmt(func->body);
+    gen_epilogue(func);
+}
+
+// `.file 1 "<name>"`, with `"`, `\` and non-printable bytes escaped for the assembler
+static void gen_file_directive(char *name) {
+    fprintf(output_file, "  .file 1 \"");
+    for (unsigned char *p = (unsigned char *)name; *p; p++) {
+        if (*p == '"' || *p == '\\')
+            fprintf(output_file, "\\%c", *p);
+        else if (isprint(*p))
+            fputc(*p, output_file);
+        else
+            fprintf(output_file, "\\%03o", *p);
+    }
+    println("\"");
+}
+
+// start a unit written to `out`, functions follow one at a time
+void codegen_start(FILE *out) {
+    output_file = out;
+    ncounters = 0;
+    label_cnt = 0;
+    if (opt_debug)
+        gen_file_directive(input_filename());
+}
+
+void codegen_function(Function *func) {
+    gen_function(func);
+}
 
-    // restore stack
-    printf(".L.RETURN:\n");
-    printf("  mov %%rbp, %%rsp\n");
-    printf("  pop %%rbp\n");
-    printf("  ret\n");
-}
\ No newline at end of file
+/**
+ * @brief start a function whose statements follow one at a time (--stream)
+ * 
+ * Without the body there are no live ranges: every variable gets its own slot.
+ * The caller found the locals, and whether the function calls or takes addresses.
+ * 
+ * @param tok the "{" which opens the body
+ */
+void codegen_function_begin(Function *func, Token *tok) {
+    current_fn = func;
+    depth = 0;
+    ncold = 0;
+    last_line = 0;
+    assign_fixed_offsets(func);
+    gen_prologue(func, tok);
+}
+
+void codegen_stmt(Node *node) {
+    gen_stmt(node);
+}
+
+void codegen_function_end(void) {
+    gen_epilogue(current_fn);
+}
+
+// everything that follows the functions of a unit
+void codegen_finish(void) {
+    if (opt_profile_generate && ncounters > 0)
+        gen_profile_dump();
+}
+
+void codegen(Function *prog, FILE *out) {
+    codegen_start(out);
+    for (Function *func = prog; func; func = func->next) {
+        gen_function(func);
+    }
+    codegen_finish();
+}
@@ -1,31 +1,583 @@
 /**
  * @file main.c
  * @author wuyangjun (wuyangjun21@163.com)
- * @brief the control program: input(String) -> tokenize(Token) -> parse(AST) -> codegen(ASM)
+ * @brief the control program: input(File) -> tokenize(Token) -> parse(AST) -> codegen(ASM),
+ *        every input file is an independent job of a work-stealing thread pool
  * @version 0.1
  * @date 2022-07-25
- * 
+ *
  * @copyright Copyright (c) 2022
- * 
+ *
  */
 
 #include "chibicc_wyj.h"
+#include <spawn.h>
+#include <sys/wait.h>
+#include <stdatomic.h>
 
-int main(int argc, char **argv) {
-    // input arguments error check
-    if (argc != 2) {
-        error("%s: invalid number of arguments\n", argv[0]);
-        return 1;
-    }
-    
-    // tokenize input string
-    Token *tok = tokenize(argv[1]);
-    
-    // parse token into syntax tree
-    Function *func = parse(tok);
-    
-    // generate asm code from syntax tree
-    codegen(func);
-    
+extern char **environ;
+
+// command line options
+static char *opt_o;         // output path, only valid with a single input
+static bool opt_c;          // assemble into object file instead of stopping at assembly
+static int opt_j;           // number of worker threads, 0 means one per CPU
+static char *opt_cache_dir; // compilation cache directory, NULL disables the cache
+static size_t opt_cache_size = 256 << 20;   // cache size limit in bytes
+static bool opt_cache_stats;    // print hit/miss statistics at exit
+static bool opt_emit_ast;   // stop after parse, write the binary AST
+static bool opt_from_ast;   // inputs are binary ASTs, skip tokenize/parse
+static bool opt_pipeline;   // always tokenize on a second thread, not only large inputs
+static bool opt_stream;     // compile a statement at a time in bounded memory
+static int opt_error_limit = 20;    // stop after this many errors per file, 0 means no limit
+
+// read by codegen
+int opt_level;              // -O<n>
+bool opt_avx2;              // -mavx2
+char *opt_profile_generate; // -fprofile-generate[=<file>]
+char *opt_profile_use;      // -fprofile-use[=<file>]
+bool opt_debug;             // -g
+int opt_unroll = 4;         // -funroll-factor=<n>, copies of a loop body with a known trip count
+int opt_constexpr_steps = 1 << 20;  // -fconstexpr-steps=<n>, budget of loops evaluated while compiling
+
+#define DEFAULT_PROFILE "chibicc-wyj.prof"
+
+// inputs this large are tokenized on a second thread while they are parsed
+#define PIPELINE_MIN_SIZE (1 << 20)
+
+// identity of this compiler binary and the flags which change the output, part of every cache key
+static uint8_t compiler_digest[32];
+static char cache_flags[256];
+
+static atomic_int cache_hits;
+static atomic_int cache_misses;
+static atomic_int cache_evictions;
+
+static char **input_paths;
+static int input_cnt;
+
+// compilation of one input file
+typedef struct {
+    char *input;        // source path
+    char *output;       // .s / .o path
+    char *diag;         // buffered diagnostics, printed in input order
+    size_t diag_len;
+    bool failed;
+    uint8_t key[32];    // cache key
+    char *cached;       // output found in the cache
+    size_t cached_len;
+    char *src;          // source text, released once the job is done
+    size_t src_len;
+    bool src_mapped;
+} Job;
+
+static void usage(int status) {
+    fprintf(stderr, "usage: chibicc-wyj [-S | -c | --emit-ast] [--from-ast] [-j N] [-o <file>]\n"
+                    "                   [-O<n>] [-mavx2] [-g] [-ferror-limit=<n>]\n"
+                    "                   [-funroll-factor=<n>] [-fconstexpr-steps=<n>]\n"
+                    "                   [-fprofile-generate[=<file>] | -fprofile-use[=<file>]]\n"
+                    "                   [--cache-dir=<dir>] [--cache-size=<n>[K|M|G]] [--cache-stats]\n"
+                    "                   [--pipeline | --stream] <file>...\n");
+    fprintf(stderr, "  <file> is a source file, or '-' for stdin\n");
+    exit(status);
+}
+
+// 64K, 16M, 1G...
+static size_t parse_size(char *s) {
+    char *end;
+    size_t n = strtoull(s, &end, 10);
+    if (end == s)
+        error("invalid size: %s", s);
+    switch (*end) {
+    case 'G': case 'g': return n << 30;
+    case 'M': case 'm': return n << 20;
+    case 'K': case 'k': return n << 10;
+    case '\0': return n;
+    }
+    error("invalid size: %s", s);
     return 0;
 }
+
+static void parse_args(int argc, char **argv) {
+    input_paths = calloc(argc, sizeof(char *));
+    opt_cache_dir = getenv("CHIBICC_WYJ_CACHE_DIR");
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--help"))
+            usage(0);
+
+        if (!strcmp(argv[i], "-o")) {
+            if (++i == argc)
+                usage(1);
+            opt_o = argv[i];
+            continue;
+        }
+        if (!strncmp(argv[i], "-o", 2)) {
+            opt_o = argv[i] + 2;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-j")) {
+            if (++i == argc)
+                usage(1);
+            opt_j = atoi(argv[i]);
+            continue;
+        }
+        if (!strncmp(argv[i], "-j", 2)) {
+            opt_j = atoi(argv[i] + 2);
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-S")) {
+            opt_c = false;
+            continue;
+        }
+        if (!strcmp(argv[i], "-c")) {
+            opt_c = true;
+            continue;
+        }
+
+        // -O is -O1
+        if (!strncmp(argv[i], "-O", 2)) {
+            opt_level = argv[i][2] ? atoi(argv[i] + 2) : 1;
+            continue;
+        }
+        if (!strcmp(argv[i], "-mavx2")) {
+            opt_avx2 = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-g")) {
+            opt_debug = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fprofile-generate")) {
+            opt_profile_generate = DEFAULT_PROFILE;
+            continue;
+        }
+        if (!strncmp(argv[i], "-fprofile-generate=", 19)) {
+            opt_profile_generate = argv[i] + 19;
+            continue;
+        }
+        if (!strcmp(argv[i], "-fprofile-use")) {
+            opt_profile_use = DEFAULT_PROFILE;
+            continue;
+        }
+        if (!strncmp(argv[i], "-fprofile-use=", 14)) {
+            opt_profile_use = argv[i] + 14;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "-funroll-factor=", 16)) {
+            opt_unroll = atoi(argv[i] + 16);
+            continue;
+        }
+        if (!strncmp(argv[i], "-fconstexpr-steps=", 18)) {
+            opt_constexpr_steps = atoi(argv[i] + 18);
+            continue;
+        }
+
+        if (!strncmp(argv[i], "-ferror-limit=", 14)) {
+            opt_error_limit = atoi(argv[i] + 14);
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--emit-ast")) {
+            opt_emit_ast = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--from-ast")) {
+            opt_from_ast = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--pipeline")) {
+            opt_pipeline = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--stream")) {
+            opt_stream = true;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--cache-dir=", 12)) {
+            opt_cache_dir = argv[i] + 12;
+            continue;
+        }
+        if (!strncmp(argv[i], "--cache-size=", 13)) {
+            opt_cache_size = parse_size(argv[i] + 13);
+            continue;
+        }
+        if (!strcmp(argv[i], "--cache-stats")) {
+            opt_cache_stats = true;
+            continue;
+        }
+
+        if (argv[i][0] == '-' && argv[i][1] != '\0')
+            error("unknown argument: %s", argv[i]);
+
+        input_paths[input_cnt++] = argv[i];
+    }
+
+    if (input_cnt == 0)
+        error("no input files");
+    if (opt_o && input_cnt > 1)
+        error("cannot specify '-o' with multiple files");
+    if (opt_emit_ast && opt_c)
+        error("cannot specify both '-c' and '--emit-ast'");
+    // `as` needs a file to write the object to
+    for (int i = 0; i < input_cnt && opt_c; i++) {
+        if (opt_o ? !strcmp(opt_o, "-") : !strcmp(input_paths[i], "-"))
+            error("cannot write an object file to stdout, specify '-o <file>'");
+    }
+    if (opt_profile_generate && opt_profile_use)
+        error("cannot specify both '-fprofile-generate' and '-fprofile-use'");
+    // the optimizations, the profile and the binary AST need a whole function
+    if (opt_stream && opt_level > 0)
+        error("cannot specify both '-O' and '--stream'");
+    if (opt_stream && (opt_profile_generate || opt_profile_use))
+        error("cannot specify both '-fprofile-*' and '--stream'");
+    if (opt_stream && (opt_emit_ast || opt_from_ast))
+        error("cannot specify both '--emit-ast' / '--from-ast' and '--stream'");
+    if (opt_stream && opt_pipeline)
+        error("cannot specify both '--pipeline' and '--stream'");
+    if (opt_j <= 0)
+        opt_j = sysconf(_SC_NPROCESSORS_ONLN);
+    set_error_limit(opt_error_limit > 0 ? opt_error_limit : INT32_MAX);
+    if (opt_cache_dir && !*opt_cache_dir)
+        opt_cache_dir = NULL;
+}
+
+// key = SHA-256(compiler binary digest, flags, source text), plus the path with -g
+static void cache_key(uint8_t key[32], char *path, char *src, size_t len) {
+    Sha256 ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, compiler_digest, sizeof(compiler_digest));
+    sha256_update(&ctx, cache_flags, strlen(cache_flags) + 1);
+    // debug line info names the source file
+    if (opt_debug)
+        sha256_update(&ctx, path, strlen(path) + 1);
+    sha256_update(&ctx, src, len);
+    sha256_final(&ctx, key);
+}
+
+static void init_cache(void) {
+    size_t len;
+    bool mapped;
+    char *exe = read_file("/proc/self/exe", &len, &mapped);
+    Sha256 ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, exe, len);
+    free_file(exe, len, mapped);
+    // the profile decides the code layout, so it's an input of every compilation
+    if (opt_profile_use) {
+        char *prof = read_file(opt_profile_use, &len, &mapped);
+        sha256_update(&ctx, prof, len);
+        free_file(prof, len, mapped);
+    }
+    if (opt_profile_generate)
+        sha256_update(&ctx, opt_profile_generate, strlen(opt_profile_generate) + 1);
+    sha256_final(&ctx, compiler_digest);
+
+    snprintf(cache_flags, sizeof(cache_flags), "%s%s%s -O%d -funroll-factor=%d -fconstexpr-steps=%d%s%s%s%s",
+             opt_emit_ast ? "--emit-ast" : opt_c ? "-c" : "-S", opt_from_ast ? " --from-ast" : "",
+             opt_stream ? " --stream" : "",
+             opt_level, opt_unroll, opt_constexpr_steps, opt_avx2 ? " -mavx2" : "", opt_debug ? " -g" : "",
+             opt_profile_generate ? " -fprofile-generate" : "", opt_profile_use ? " -fprofile-use" : "");
+}
+
+// foo/bar.c => foo/bar.s (or foo/bar.o with -c)
+static char *replace_extn(char *path, char *extn) {
+    char *dot = strrchr(path, '.');
+    char *slash = strrchr(path, '/');
+    int len = (dot && (!slash || dot > slash)) ? dot - path : strlen(path);
+    char *buf = calloc(1, len + strlen(extn) + 1);
+    memcpy(buf, path, len);
+    strcpy(buf + len, extn);
+    return buf;
+}
+
+static bool write_file(char *path, char *buf, size_t len) {
+    FILE *out = strcmp(path, "-") ? fopen(path, "w") : stdout;
+    if (!out)
+        return false;
+    bool ok = fwrite(buf, 1, len, out) == len;
+    if (out != stdout)
+        ok = (fclose(out) == 0) && ok;
+    else
+        ok = (fflush(out) == 0) && ok;
+    return ok;
+}
+
+// copy the file at `src` to `path` ("-" is stdout) a block at a time
+static bool copy_file(char *path, char *src) {
+    FILE *in = fopen(src, "r");
+    if (!in)
+        return false;
+    FILE *out = strcmp(path, "-") ? fopen(path, "w") : stdout;
+    if (!out) {
+        fclose(in);
+        return false;
+    }
+    char buf[1 << 16];
+    bool ok = true;
+    for (size_t n; ok && (n = fread(buf, 1, sizeof(buf), in)) > 0;)
+        ok = fwrite(buf, 1, n, out) == n;
+    ok = !ferror(in) && ok;
+    fclose(in);
+    if (out != stdout)
+        ok = (fclose(out) == 0) && ok;
+    else
+        ok = (fflush(out) == 0) && ok;
+    return ok;
+}
+
+// `tmp` is a mkstemp() template, which becomes the name of the new file
+static FILE *open_temp(char *tmp, FILE *diag) {
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        fprintf(diag, "cannot create temporary file: %s\n", strerror(errno));
+        return NULL;
+    }
+    return fdopen(fd, "w");
+}
+
+// run `as` on the assembly file at `asm_path`
+static bool run_as(Job *job, char *asm_path, FILE *diag) {
+    char *argv[] = {"as", "-o", job->output, asm_path, NULL};
+    pid_t pid;
+    int status;
+    bool ok = posix_spawnp(&pid, "as", NULL, NULL, argv, environ) == 0 &&
+              waitpid(pid, &status, 0) == pid &&
+              WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (!ok)
+        fprintf(diag, "%s: assembler failed\n", job->input);
+    return ok;
+}
+
+// run `as` on the generated assembly
+static bool assemble(Job *job, char *asm_buf, size_t asm_len, FILE *diag) {
+    char tmp[] = "/tmp/chibicc-wyj-XXXXXX";
+    FILE *out = open_temp(tmp, diag);
+    if (!out)
+        return false;
+    fclose(out);
+
+    bool ok = write_file(tmp, asm_buf, asm_len);
+    if (ok)
+        ok = run_as(job, tmp, diag);
+    else
+        fprintf(diag, "cannot write %s: %s\n", tmp, strerror(errno));
+    unlink(tmp);
+    return ok;
+}
+
+// the lexer thread is still reading while each function is parsed, then generated right away
+static void compile_pipelined(Job *job, char *buf, size_t len, FILE *out) {
+    tokenize_async(job->input, buf, len);
+    parse_start();
+    codegen_start(out);
+    for (Token *tok = async_tokens(); tok->kind != TK_EOF;) {
+        Function *func = parse_toplevel(&tok, tok);
+        // the output is dropped after any error, stop generating
+        if (has_errors())
+            continue;
+        if (opt_level > 0)
+            optimize(func);
+        codegen_function(func);
+    }
+    tokenize_async_end();
+    // every error was reported, don't generate code
+    if (has_errors())
+        fatal();
+    codegen_finish();
+}
+
+/**
+ * @brief read, parse and generate one statement at a time, memory doesn't grow with the input
+ * 
+ * A prescan of each function body finds its locals, so the frame is laid out before
+ * the first statement. The tokens and nodes of a statement live in the arena, which
+ * is reset once the statement was generated.
+ */
+static void compile_streamed(Job *job, char *buf, size_t len, FILE *out) {
+    arena_begin();
+    tokenize_stream(job->input, buf, len);
+    parse_start();
+    codegen_start(out);
+    for (Token *tok; (tok = stream_tokens(true))->kind != TK_EOF; arena_reset()) {
+        Function *func = parse_stream_function(tok);
+        // the output is dropped after any error, stop generating
+        if (!has_errors())
+            codegen_function_begin(func, tok);
+        arena_reset();
+
+        while ((tok = stream_tokens(false))->kind != TK_EOF && !equal(tok, "}")) {
+            Node *node = parse_stream_stmt(tok);
+            if (node && !has_errors())
+                codegen_stmt(node);
+            arena_reset();
+        }
+        if (tok->kind == TK_EOF)
+            error_tok(tok, "expected '}'");
+
+        if (!has_errors())
+            codegen_function_end();
+        parse_stream_end(func);
+    }
+    // every error was reported, don't generate code
+    if (has_errors())
+        fatal();
+    codegen_finish();
+    arena_end();
+}
+
+// tokenize/parse/codegen one file, fatal errors jump back here instead of exiting
+static bool compile(Job *job, FILE *out) {
+    jmp_buf trap;
+    jmp_buf *prev = set_error_trap(&trap);
+    bool ok = false;
+
+    if (setjmp(trap) == 0) {
+        job->src = read_file(job->input, &job->src_len, &job->src_mapped);
+        char *buf = job->src;
+        size_t len = job->src_len;
+
+        if (opt_cache_dir) {
+            cache_key(job->key, job->input, buf, len);
+            if (cache_lookup(opt_cache_dir, job->key, &job->cached, &job->cached_len)) {
+                atomic_fetch_add(&cache_hits, 1);
+                set_error_trap(prev);
+                return true;
+            }
+            atomic_fetch_add(&cache_misses, 1);
+        }
+
+        if (opt_stream) {
+            compile_streamed(job, buf, len, out);
+            set_error_trap(prev);
+            return true;
+        }
+        if (!opt_from_ast && !opt_emit_ast && (opt_pipeline || len >= PIPELINE_MIN_SIZE)) {
+            compile_pipelined(job, buf, len, out);
+            set_error_trap(prev);
+            return true;
+        }
+
+        Function *func;
+        if (opt_from_ast) {
+            func = load_ast(job->input, buf, len);
+        } else {
+            Token *tok = tokenize(job->input, buf, len);
+            func = parse(tok);
+        }
+
+        if (opt_emit_ast) {
+            emit_ast(func, buf, len, out);
+        } else {
+            // the binary AST stays as parsed, only code is optimized
+            for (Function *fn = func; fn && opt_level > 0; fn = fn->next) {
+                optimize(fn);
+            }
+            codegen(func, out);
+        }
+        ok = true;
+    }
+
+    // a fatal error may leave the lexer thread running, or the arena in use
+    tokenize_async_end();
+    arena_end();
+    set_error_trap(prev);
+    return ok;
+}
+
+// a failed store only costs a later miss, it never fails the compilation
+static void store_result(int evicted) {
+    if (evicted > 0)
+        atomic_fetch_add(&cache_evictions, evicted);
+}
+
+static void run_job(void *ctx, int i) {
+    Job *job = &((Job *)ctx)[i];
+    FILE *diag = open_memstream(&job->diag, &job->diag_len);
+    set_diag_output(diag);
+
+    // --stream: the assembly goes to a temporary file instead of memory
+    char *asm_buf = NULL;
+    size_t asm_len = 0;
+    char tmp[] = "/tmp/chibicc-wyj-XXXXXX";
+    FILE *out = opt_stream ? open_temp(tmp, diag) : open_memstream(&asm_buf, &asm_len);
+    bool ok = out && compile(job, out);
+    if (out && fclose(out) != 0 && ok) {
+        fprintf(diag, "cannot write %s: %s\n", tmp, strerror(errno));
+        ok = false;
+    }
+
+    if (ok && job->cached) {
+        if (!write_file(job->output, job->cached, job->cached_len)) {
+            fprintf(diag, "cannot write %s: %s\n", job->output, strerror(errno));
+            ok = false;
+        }
+        free(job->cached);
+    } else if (ok && opt_c) {
+        ok = opt_stream ? run_as(job, tmp, diag) : assemble(job, asm_buf, asm_len, diag);
+        if (ok && opt_cache_dir)
+            store_result(cache_store_file(opt_cache_dir, job->key, job->output, opt_cache_size));
+    } else if (ok) {
+        bool written = opt_stream ? copy_file(job->output, tmp) : write_file(job->output, asm_buf, asm_len);
+        if (!written) {
+            fprintf(diag, "cannot write %s: %s\n", job->output, strerror(errno));
+            ok = false;
+        } else if (opt_cache_dir && opt_stream) {
+            store_result(cache_store_file(opt_cache_dir, job->key, tmp, opt_cache_size));
+        } else if (opt_cache_dir) {
+            store_result(cache_store(opt_cache_dir, job->key, asm_buf, asm_len, opt_cache_size));
+        }
+    }
+    job->failed = !ok;
+    if (job->src)
+        free_file(job->src, job->src_len, job->src_mapped);
+    if (opt_stream && out)
+        unlink(tmp);
+
+    free(asm_buf);
+    set_diag_output(NULL);
+    fclose(diag);
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+    if (opt_profile_use)
+        load_profile(opt_profile_use);
+    if (opt_cache_dir)
+        init_cache();
+
+    Job *jobs = calloc(input_cnt, sizeof(Job));
+    for (int i = 0; i < input_cnt; i++) {
+        jobs[i].input = input_paths[i];
+        if (opt_o)
+            jobs[i].output = opt_o;
+        else if (!strcmp(input_paths[i], "-"))
+            jobs[i].output = "-";
+        else
+            jobs[i].output = replace_extn(input_paths[i], opt_emit_ast ? ".ast" : opt_c ? ".o" : ".s");
+    }
+
+    pool_run(opt_j, input_cnt, run_job, jobs);
+
+    // report in the order of command line, whichever worker finished first
+    int status = 0;
+    for (int i = 0; i < input_cnt; i++) {
+        fwrite(jobs[i].diag, 1, jobs[i].diag_len, stderr);
+        if (jobs[i].failed)
+            status = 1;
+    }
+
+    if (opt_cache_stats) {
+        int hits = atomic_load(&cache_hits);
+        int misses = atomic_load(&cache_misses);
+        fprintf(stderr, "cache: %d hits, %d misses (%.1f%% hit rate), %d evicted\n",
+                hits, misses, hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+                atomic_load(&cache_evictions));
+    }
+    return status;
+}
@@ -0,0 +1,1092 @@
+/**
+ * @file opt.c
+ * @author wuyangjun (wuyangjun21@163.com)
+ * @brief AST optimizations between parse and codegen (-O): compile-time evaluation
+ *        of constant loops, loop-invariant code motion, common subexpression
+ *        elimination by value numbering over the dominator tree
+ * @version 0.1
+ * @date 2022-09-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "chibicc_wyj.h"
+
+//
+// Shared by the passes: dense ids of variables, AST helpers
+//
+
+typedef struct {
+    Variable **vars;
+    int len;
+    int cap;
+    int *table;         // hash => index into vars, -1 if empty
+    int cap_table;
+} VarIds;
+
+static uint64_t hash3(uint64_t a, uint64_t b, uint64_t c) {
+    uint64_t x = a * 0x9e3779b97f4a7c15ULL ^ b * 0xff51afd7ed558ccdULL ^ c * 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static void ids_put(VarIds *ids, int idx) {
+    int i = hash3((uintptr_t)ids->vars[idx], 0, 0) & (ids->cap_table - 1);
+    while (ids->table[i] != -1)
+        i = (i + 1) & (ids->cap_table - 1);
+    ids->table[i] = idx;
+}
+
+// id of `var`, numbered on first sight
+static int var_id(VarIds *ids, Variable *var) {
+    if (ids->cap_table) {
+        int i = hash3((uintptr_t)var, 0, 0) & (ids->cap_table - 1);
+        for (; ids->table[i] != -1; i = (i + 1) & (ids->cap_table - 1)) {
+            if (ids->vars[ids->table[i]] == var)
+                return ids->table[i];
+        }
+    }
+
+    if (ids->len == ids->cap) {
+        ids->cap = ids->cap ? ids->cap * 2 : 64;
+        ids->vars = realloc(ids->vars, ids->cap * sizeof(Variable *));
+    }
+    ids->vars[ids->len] = var;
+    if ((ids->len + 1) * 2 > ids->cap_table) {
+        free(ids->table);
+        ids->cap_table = ids->cap_table ? ids->cap_table * 2 : 128;
+        ids->table = malloc(ids->cap_table * sizeof(int));
+        memset(ids->table, -1, ids->cap_table * sizeof(int));
+        for (int i = 0; i < ids->len; i++) {
+            ids_put(ids, i);
+        }
+    }
+    ids_put(ids, ids->len);
+    return ids->len++;
+}
+
+static void free_ids(VarIds *ids) {
+    free(ids->vars);
+    free(ids->table);
+}
+
+static void make_var_node(Node *node, Variable *var) {
+    node->kind = ND_VAR;
+    node->lvar = var;
+    node->name = var->name;
+    node->lhs = node->rhs = NULL;
+}
+
+// a new local `<prefix><n>`, last in the list so the layout of user variables stays the same
+static Variable *new_temp(Function *func, char *prefix, int n, Type *ty) {
+    Variable *var = calloc(1, sizeof(Variable));
+    char *name = calloc(1, 24);
+    snprintf(name, 24, "%s%d", prefix, n);
+    var->name = name;
+    var->ty = ty ? ty : ty_int;
+
+    Variable **p = &func->locals;
+    while (*p)
+        p = &(*p)->next;
+    *p = var;
+    return var;
+}
+
+// mark the variables `node` and the nodes after it assign, by id
+static void mark_assigned(VarIds *ids, Node *node, bool *assigned) {
+    for (; node; node = node->next) {
+        if (node->kind == ND_ASSIGN && node->lhs->kind == ND_VAR)
+            assigned[var_id(ids, node->lhs->lvar)] = true;
+        mark_assigned(ids, node->lhs, assigned);
+        mark_assigned(ids, node->rhs, assigned);
+        mark_assigned(ids, node->body, assigned);
+        mark_assigned(ids, node->cond, assigned);
+        mark_assigned(ids, node->then, assigned);
+        mark_assigned(ids, node->els, assigned);
+        mark_assigned(ids, node->init, assigned);
+        mark_assigned(ids, node->inc, assigned);
+        mark_assigned(ids, node->args, assigned);
+    }
+}
+
+static bool has_addr(Node *node) {
+    for (; node; node = node->next) {
+        if (node->kind == ND_ADDR)
+            return true;
+        if (has_addr(node->lhs) || has_addr(node->rhs) || has_addr(node->body) ||
+            has_addr(node->cond) || has_addr(node->then) || has_addr(node->els) ||
+            has_addr(node->init) || has_addr(node->inc) || has_addr(node->args))
+            return true;
+    }
+    return false;
+}
+
+//
+// Compile-time evaluation of loops
+//
+// Constants are propagated through the function in statement order. A loop
+// which only computes with variables known at its start, and whose effects
+// are assignments to variables, is run here, within opt_constexpr_steps
+// evaluated nodes, and replaced by assignments of the final values. Every
+// value is computed like the generated code does: 64-bit, wrapping.
+//
+// A function which takes an address is left alone, a store through a pointer
+// might change any variable there. Otherwise a store or a call can't.
+//
+
+typedef struct {
+    VarIds ids;
+    int64_t *vals;      // by variable id
+    bool *known;
+    int steps;          // left to the loop being evaluated
+} Fold;
+
+// value of `node` if every variable it reads is known; assignments update what is known
+static bool track(Fold *f, Node *node, int64_t *val) {
+    if (--f->steps < 0)
+        return false;
+
+    int64_t a, b;
+    switch (node->kind) {
+    case ND_NUM:
+        *val = node->value;
+        return true;
+    case ND_VAR: {
+        int id = var_id(&f->ids, node->lvar);
+        *val = f->vals[id];
+        return f->known[id];
+    }
+    case ND_ASSIGN: {
+        if (node->lhs->kind != ND_VAR) {
+            track(f, node->lhs->lhs, &a);
+            track(f, node->rhs, &b);
+            return false;
+        }
+        int id = var_id(&f->ids, node->lhs->lvar);
+        f->known[id] = track(f, node->rhs, &f->vals[id]);
+        *val = f->vals[id];
+        return f->known[id];
+    }
+    case ND_NEG:
+        if (!track(f, node->lhs, &a))
+            return false;
+        *val = (int64_t)(0 - (uint64_t)a);
+        return true;
+    case ND_ADDR:
+    case ND_DEREF:
+        track(f, node->lhs, &a);
+        return false;
+    case ND_FUNCALL:
+        for (Node *arg = node->args; arg; arg = arg->next) {
+            track(f, arg, &a);
+        }
+        return false;
+    default:
+        break;
+    }
+
+    // binary operators, rhs is evaluated first
+    bool known = track(f, node->rhs, &b);
+    if (!track(f, node->lhs, &a) || !known)
+        return false;
+    switch (node->kind) {
+    case ND_ADD:
+        *val = (int64_t)((uint64_t)a + (uint64_t)b);
+        return true;
+    case ND_SUB:
+        *val = (int64_t)((uint64_t)a - (uint64_t)b);
+        return true;
+    case ND_MUL:
+        *val = (int64_t)((uint64_t)a * (uint64_t)b);
+        return true;
+    case ND_DIV:
+        // traps at runtime
+        if (b == 0 || (a == INT64_MIN && b == -1))
+            return false;
+        *val = a / b;
+        return true;
+    case ND_EQ:
+        *val = a == b;
+        return true;
+    case ND_NE:
+        *val = a != b;
+        return true;
+    case ND_LT:
+        *val = a < b;
+        return true;
+    case ND_LE:
+        *val = a <= b;
+        return true;
+    case ND_GT:
+        *val = a > b;
+        return true;
+    case ND_GE:
+        *val = a >= b;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// whether the loop `node` has effects beyond assigning variables
+static bool has_effects(Node *node) {
+    for (; node; node = node->next) {
+        if (node->kind == ND_DEREF || node->kind == ND_ADDR || node->kind == ND_FUNCALL ||
+            node->kind == ND_RETURN)
+            return true;
+        if (has_effects(node->lhs) || has_effects(node->rhs) || has_effects(node->body) ||
+            has_effects(node->cond) || has_effects(node->then) || has_effects(node->els) ||
+            has_effects(node->init) || has_effects(node->inc))
+            return true;
+    }
+    return false;
+}
+
+// run statement `node` of an effect-free loop, false if a condition isn't known
+static bool run(Fold *f, Node *node) {
+    int64_t val;
+    if (--f->steps < 0)
+        return false;
+    switch (node->kind) {
+    case ND_EXPR_STMT:
+        track(f, node->lhs, &val);
+        return true;
+    case ND_BLOCK:
+        for (Node *n = node->body; n; n = n->next) {
+            if (!run(f, n))
+                return false;
+        }
+        return true;
+    case ND_IF:
+        if (!track(f, node->cond, &val))
+            return false;
+        if (val)
+            return run(f, node->then);
+        return !node->els || run(f, node->els);
+    case ND_FOR:
+        if (node->init && !run(f, node->init))
+            return false;
+        for (;;) {
+            if (node->cond) {
+                if (!track(f, node->cond, &val))
+                    return false;
+                if (!val)
+                    return true;
+            }
+            if (!run(f, node->then))
+                return false;
+            if (node->inc)
+                track(f, node->inc, &val);
+            // without a condition the budget ends the loop
+            if (--f->steps < 0)
+                return false;
+        }
+    default:
+        return false;
+    }
+}
+
+static void fold_stmt(Fold *f, Node *node);
+
+// the loop `node`, init has run: replace it with its final assignments if it can run here
+static bool fold_loop(Fold *f, Node *node, bool *assigned) {
+    if (opt_constexpr_steps <= 0 || has_effects(node->cond) || has_effects(node->then) ||
+        has_effects(node->inc))
+        return false;
+
+    int n = f->ids.len;
+    int64_t *vals = malloc(n * sizeof(int64_t));
+    bool *known = malloc(n * sizeof(bool));
+    memcpy(vals, f->vals, n * sizeof(int64_t));
+    memcpy(known, f->known, n * sizeof(bool));
+
+    Node loop = *node;
+    loop.init = NULL;
+    f->steps = opt_constexpr_steps;
+    bool ok = run(f, &loop);
+    f->steps = INT_MAX;
+
+    // the final values must be known, and fit in a number literal
+    for (int i = 0; i < n && ok; i++) {
+        if (assigned[i])
+            ok = f->known[i] && f->vals[i] >= INT_MIN && f->vals[i] <= INT_MAX;
+    }
+    if (!ok) {
+        memcpy(f->vals, vals, n * sizeof(int64_t));
+        memcpy(f->known, known, n * sizeof(bool));
+        free(vals);
+        free(known);
+        return false;
+    }
+    free(vals);
+    free(known);
+
+    // init; v1 = c1; v2 = c2; ...
+    Node head = {};
+    Node *cur = &head;
+    for (int i = 0; i < n; i++) {
+        if (!assigned[i])
+            continue;
+        Node *var = calloc(1, sizeof(Node));
+        make_var_node(var, f->ids.vars[i]);
+        var->tok = node->tok;
+        var->ty = f->ids.vars[i]->ty;
+        Node *num = calloc(1, sizeof(Node));
+        num->kind = ND_NUM;
+        num->value = f->vals[i];
+        num->tok = node->tok;
+        num->ty = ty_int;
+        Node *assign = calloc(1, sizeof(Node));
+        assign->kind = ND_ASSIGN;
+        assign->lhs = var;
+        assign->rhs = num;
+        assign->tok = node->tok;
+        assign->ty = var->ty;
+        cur = cur->next = calloc(1, sizeof(Node));
+        cur->kind = ND_EXPR_STMT;
+        cur->lhs = assign;
+        cur->tok = node->tok;
+    }
+    if (node->init) {
+        node->init->next = head.next;
+        head.next = node->init;
+    }
+    node->kind = ND_BLOCK;
+    node->body = head.next;
+    node->init = node->cond = node->then = node->inc = NULL;
+    return true;
+}
+
+// forget the variables `node` may assign
+static void forget(Fold *f, Node *node) {
+    bool *assigned = calloc(f->ids.len, sizeof(bool));
+    mark_assigned(&f->ids, node, assigned);
+    for (int i = 0; i < f->ids.len; i++) {
+        if (assigned[i])
+            f->known[i] = false;
+    }
+    free(assigned);
+}
+
+static void fold_stmt(Fold *f, Node *node) {
+    int64_t val;
+    int n = f->ids.len;
+    switch (node->kind) {
+    case ND_EXPR_STMT:
+    case ND_RETURN:
+        track(f, node->lhs, &val);
+        return;
+    case ND_BLOCK:
+        for (Node *stmt = node->body; stmt; stmt = stmt->next) {
+            fold_stmt(f, stmt);
+        }
+        return;
+    case ND_IF: {
+        track(f, node->cond, &val);
+        // each branch starts from what is known after the condition
+        int64_t *vals = malloc(n * sizeof(int64_t));
+        bool *known = malloc(n * sizeof(bool));
+        memcpy(vals, f->vals, n * sizeof(int64_t));
+        memcpy(known, f->known, n * sizeof(bool));
+        fold_stmt(f, node->then);
+        memcpy(f->vals, vals, n * sizeof(int64_t));
+        memcpy(f->known, known, n * sizeof(bool));
+        if (node->els) {
+            fold_stmt(f, node->els);
+            memcpy(f->vals, vals, n * sizeof(int64_t));
+            memcpy(f->known, known, n * sizeof(bool));
+        }
+        free(vals);
+        free(known);
+        forget(f, node->then);
+        if (node->els)
+            forget(f, node->els);
+        return;
+    }
+    case ND_FOR: {
+        if (node->init)
+            fold_stmt(f, node->init);
+        bool *assigned = calloc(n, sizeof(bool));
+        mark_assigned(&f->ids, node->cond, assigned);
+        mark_assigned(&f->ids, node->then, assigned);
+        mark_assigned(&f->ids, node->inc, assigned);
+        if (!fold_loop(f, node, assigned)) {
+            // the body may hold loops which can still run here
+            for (int i = 0; i < n; i++) {
+                if (assigned[i])
+                    f->known[i] = false;
+            }
+            fold_stmt(f, node->then);
+            for (int i = 0; i < n; i++) {
+                if (assigned[i])
+                    f->known[i] = false;
+            }
+        }
+        free(assigned);
+        return;
+    }
+    default:
+        return;
+    }
+}
+
+static void fold_loops(Function *func) {
+    Fold f = {};
+    // every variable has its id before any table is sized
+    for (Variable *var = func->locals; var; var = var->next) {
+        var_id(&f.ids, var);
+    }
+    f.vals = calloc(f.ids.len, sizeof(int64_t));
+    f.known = calloc(f.ids.len, sizeof(bool));
+    f.steps = INT_MAX;
+    fold_stmt(&f, func->body);
+
+    free_ids(&f.ids);
+    free(f.vals);
+    free(f.known);
+}
+
+//
+// Loop-invariant code motion
+//
+// Computations of a loop which give the same value in every iteration move to
+// a preheader in front of the loop, into temporaries. A variable is invariant
+// unless the loop assigns it, or its address is taken and the loop stores
+// through a pointer or calls a function. Only what can't trap moves, since the
+// preheader runs even if the loop body never does: loads and divisions stay.
+// Inner loops go first, what they hoist may move further out.
+//
+
+typedef struct {
+    Function *func;
+    bool addr_taken;
+    VarIds ids;
+    bool *taken;        // by variable id: the address is taken somewhere
+    int ntaken;
+    bool *variant;      // by variable id: may change in the loop being processed
+    int nvariant;       // temporaries made while processing it are past the end
+    int ntemps;
+    Node *pre_tail;     // last statement of the preheader being built
+} Licm;
+
+static void mark_taken(Licm *l, Node *node) {
+    for (; node; node = node->next) {
+        if (node->kind == ND_ADDR && node->lhs->kind == ND_VAR)
+            l->taken[var_id(&l->ids, node->lhs->lvar)] = true;
+        mark_taken(l, node->lhs);
+        mark_taken(l, node->rhs);
+        mark_taken(l, node->body);
+        mark_taken(l, node->cond);
+        mark_taken(l, node->then);
+        mark_taken(l, node->els);
+        mark_taken(l, node->init);
+        mark_taken(l, node->inc);
+        mark_taken(l, node->args);
+    }
+}
+
+// whether `node` or the nodes after it store through a pointer or call a function
+static bool writes_memory(Node *node) {
+    for (; node; node = node->next) {
+        if ((node->kind == ND_ASSIGN && node->lhs->kind == ND_DEREF) || node->kind == ND_FUNCALL)
+            return true;
+        if (writes_memory(node->lhs) || writes_memory(node->rhs) || writes_memory(node->body) ||
+            writes_memory(node->cond) || writes_memory(node->then) || writes_memory(node->els) ||
+            writes_memory(node->init) || writes_memory(node->inc) || writes_memory(node->args))
+            return true;
+    }
+    return false;
+}
+
+// same value in every iteration, and can't trap
+static bool invariant(Licm *l, Node *node) {
+    switch (node->kind) {
+    case ND_NUM:
+        return true;
+    case ND_VAR: {
+        int id = var_id(&l->ids, node->lvar);
+        return id < l->nvariant && !l->variant[id];
+    }
+    case ND_ADDR:
+        // the address of a local is fixed
+        return node->lhs->kind == ND_VAR;
+    case ND_NEG:
+        return invariant(l, node->lhs);
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+    case ND_GT:
+    case ND_GE:
+        return invariant(l, node->lhs) && invariant(l, node->rhs);
+    default:
+        return false;
+    }
+}
+
+// whether `node` reads the frame, a tree of numbers is left to fold where it is
+static bool reads_frame(Node *node) {
+    if (!node)
+        return false;
+    if (node->kind == ND_VAR || node->kind == ND_ADDR)
+        return true;
+    return reads_frame(node->lhs) || reads_frame(node->rhs);
+}
+
+// move the invariant parts of expression `node` to the preheader
+static void hoist(Licm *l, Node *node) {
+    if (node->kind != ND_NUM && node->kind != ND_VAR && node->kind != ND_ADDR &&
+        invariant(l, node) && reads_frame(node)) {
+        Variable *temp = new_temp(l->func, ".licm", l->ntemps++, node->ty);
+        var_id(&l->ids, temp);
+
+        // temp = node, then `node` reads temp
+        Node *copy = calloc(1, sizeof(Node));
+        *copy = *node;
+        copy->next = NULL;
+        Node *lhs = calloc(1, sizeof(Node));
+        make_var_node(lhs, temp);
+        lhs->tok = node->tok;
+        lhs->ty = temp->ty;
+        Node *assign = calloc(1, sizeof(Node));
+        assign->kind = ND_ASSIGN;
+        assign->lhs = lhs;
+        assign->rhs = copy;
+        assign->tok = node->tok;
+        assign->ty = temp->ty;
+        Node *stmt = calloc(1, sizeof(Node));
+        stmt->kind = ND_EXPR_STMT;
+        stmt->lhs = assign;
+        stmt->tok = node->tok;
+        l->pre_tail = l->pre_tail->next = stmt;
+
+        make_var_node(node, temp);
+        return;
+    }
+
+    switch (node->kind) {
+    case ND_NUM:
+    case ND_VAR:
+        return;
+    case ND_ADDR:
+    case ND_DEREF:
+        if (node->lhs->kind != ND_VAR)
+            hoist(l, node->lhs);
+        return;
+    case ND_ASSIGN:
+        // the variable assigned stays, the address stored through may move
+        if (node->lhs->kind == ND_DEREF)
+            hoist(l, node->lhs->lhs);
+        hoist(l, node->rhs);
+        return;
+    case ND_FUNCALL:
+        for (Node *arg = node->args; arg; arg = arg->next) {
+            hoist(l, arg);
+        }
+        return;
+    case ND_NEG:
+        hoist(l, node->lhs);
+        return;
+    default:
+        hoist(l, node->lhs);
+        hoist(l, node->rhs);
+        return;
+    }
+}
+
+static void hoist_stmt(Licm *l, Node *node) {
+    switch (node->kind) {
+    case ND_EXPR_STMT:
+    case ND_RETURN:
+        hoist(l, node->lhs);
+        return;
+    case ND_BLOCK:
+        for (Node *stmt = node->body; stmt; stmt = stmt->next) {
+            hoist_stmt(l, stmt);
+        }
+        return;
+    case ND_IF:
+        hoist(l, node->cond);
+        hoist_stmt(l, node->then);
+        if (node->els)
+            hoist_stmt(l, node->els);
+        return;
+    case ND_FOR:
+        // the vectorizer matches the loop as it is written
+        if (is_vector_loop(node, l->addr_taken))
+            return;
+        if (node->init)
+            hoist_stmt(l, node->init);
+        if (node->cond)
+            hoist(l, node->cond);
+        hoist_stmt(l, node->then);
+        if (node->inc)
+            hoist(l, node->inc);
+        return;
+    default:
+        return;
+    }
+}
+
+/**
+ * @brief hoist out of the ND_FOR `node`: it becomes a block of the preheader and the loop
+ * 
+ * The preheader runs before the loop's init too, so what init assigns counts
+ * as changed by the loop.
+ */
+static void hoist_loop(Licm *l, Node *node) {
+    if (is_vector_loop(node, l->addr_taken))
+        return;
+
+    l->nvariant = l->ids.len;
+    l->variant = calloc(l->nvariant, sizeof(bool));
+    mark_assigned(&l->ids, node->init, l->variant);
+    mark_assigned(&l->ids, node->cond, l->variant);
+    mark_assigned(&l->ids, node->then, l->variant);
+    mark_assigned(&l->ids, node->inc, l->variant);
+    if (writes_memory(node->init) || writes_memory(node->cond) || writes_memory(node->then) ||
+        writes_memory(node->inc)) {
+        for (int i = 0; i < l->ntaken; i++) {
+            if (l->taken[i])
+                l->variant[i] = true;
+        }
+    }
+
+    Node head = {};
+    l->pre_tail = &head;
+    if (node->cond)
+        hoist(l, node->cond);
+    hoist_stmt(l, node->then);
+    if (node->inc)
+        hoist(l, node->inc);
+    free(l->variant);
+
+    if (!head.next)
+        return;
+    Node *loop = calloc(1, sizeof(Node));
+    *loop = *node;
+    loop->next = NULL;
+    l->pre_tail->next = loop;
+    node->kind = ND_BLOCK;
+    node->body = head.next;
+    node->init = node->cond = node->then = node->inc = NULL;
+}
+
+static void licm_stmt(Licm *l, Node *node) {
+    switch (node->kind) {
+    case ND_BLOCK:
+        for (Node *stmt = node->body; stmt; stmt = stmt->next) {
+            licm_stmt(l, stmt);
+        }
+        return;
+    case ND_IF:
+        licm_stmt(l, node->then);
+        if (node->els)
+            licm_stmt(l, node->els);
+        return;
+    case ND_FOR:
+        licm_stmt(l, node->then);
+        hoist_loop(l, node);
+        return;
+    default:
+        return;
+    }
+}
+
+static void hoist_invariants(Function *func) {
+    Licm l = {};
+    l.func = func;
+    l.addr_taken = has_addr(func->body);
+    // every user variable has its id before `taken` is sized, temporaries never have their address taken
+    for (Variable *var = func->locals; var; var = var->next) {
+        var_id(&l.ids, var);
+    }
+    l.ntaken = l.ids.len;
+    l.taken = calloc(l.ntaken, sizeof(bool));
+    mark_taken(&l, func->body);
+    licm_stmt(&l, func->body);
+
+    free_ids(&l.ids);
+    free(l.taken);
+}
+
+//
+// Common subexpression elimination
+//
+// Every expression gets a value number (VN): equal numbers mean equal values. Pure
+// expressions are numbered by (kind, VN of operands), a variable by what was last
+// assigned to it, and a load by (address VN, memory generation), where the memory
+// generation changes with every store through a pointer and every call. An
+// expression whose number is already available is replaced by a variable holding
+// it: either a variable it was assigned to, or a temporary which the first
+// occurrence now stores into (`a*b` => `cse0 = a*b`).
+//
+// Numbers are scoped along the dominator tree: a branch or a loop body sees what
+// was available before it, and what it adds is dropped when it ends. Whatever a
+// branch or loop may modify is killed after it, and before a loop too, since its
+// body runs after its own previous iteration.
+//
+
+typedef struct {
+    NodeKind kind;
+    int a, b;           // VNs of the operands; number / variable id for leaves
+    int vn;
+    Node *rep;          // first occurrence, NULL for leaves which are never replaced
+    Variable *temp;     // holds the value of `rep` once a later occurrence reused it
+    Variable *holder;   // a variable which was assigned this value
+} Expr;
+
+typedef struct {
+    int vn;
+    int gen;            // frame generation `vn` belongs to
+} VarVN;
+
+typedef struct {
+    int var;
+    int vn;
+    int gen;
+} Undo;
+
+typedef struct {
+    Function *func;
+    bool addr_taken;    // pointers may reach the frame: a store may change any variable
+    int next_vn;
+    int mem_gen;        // changed by stores through pointers and calls
+    int frame_gen;      // changed by the same, when `addr_taken`
+    int ntemps;
+
+    // available expressions, oldest first, so that a scope ends by truncation
+    Expr *exprs;
+    int nexprs;
+    int cap_exprs;
+    int *table;         // hash => index into exprs, -1 if empty
+    int cap_table;
+
+    VarIds ids;
+    VarVN *vars;        // by variable id
+    int nvars;
+    int cap_vars;
+
+    // variable VNs to restore when a scope ends
+    Undo *undo;
+    int nundo;
+    int cap_undo;
+} Cse;
+
+typedef struct {
+    int nexprs;
+    int nundo;
+} Scope;
+
+static int fresh_vn(Cse *c) {
+    return c->next_vn++;
+}
+
+//
+// variables
+//
+
+// id of `var`, its VN is fresh on first sight
+static int cse_var(Cse *c, Variable *var) {
+    int id = var_id(&c->ids, var);
+    if (id == c->nvars) {
+        if (c->nvars == c->cap_vars) {
+            c->cap_vars = c->cap_vars ? c->cap_vars * 2 : 64;
+            c->vars = realloc(c->vars, c->cap_vars * sizeof(VarVN));
+        }
+        c->vars[c->nvars++] = (VarVN){fresh_vn(c), c->frame_gen};
+    }
+    return id;
+}
+
+static int var_vn(Cse *c, Variable *var) {
+    int id = cse_var(c, var);
+    VarVN *v = &c->vars[id];
+    // a store may have changed it since
+    if (v->gen != c->frame_gen) {
+        v->vn = fresh_vn(c);
+        v->gen = c->frame_gen;
+    }
+    return v->vn;
+}
+
+static void set_var_vn(Cse *c, Variable *var, int vn) {
+    int id = cse_var(c, var);
+    if (c->nundo == c->cap_undo) {
+        c->cap_undo = c->cap_undo ? c->cap_undo * 2 : 64;
+        c->undo = realloc(c->undo, c->cap_undo * sizeof(Undo));
+    }
+    c->undo[c->nundo++] = (Undo){id, c->vars[id].vn, c->vars[id].gen};
+    c->vars[id].vn = vn;
+    c->vars[id].gen = c->frame_gen;
+}
+
+//
+// available expressions
+//
+
+static void table_put(Cse *c, int idx) {
+    Expr *e = &c->exprs[idx];
+    int i = hash3(e->kind, e->a, e->b) & (c->cap_table - 1);
+    while (c->table[i] != -1)
+        i = (i + 1) & (c->cap_table - 1);
+    c->table[i] = idx;
+}
+
+// slot of (kind, a, b) in the table, either holding it or the empty slot it would go to
+static int table_slot(Cse *c, NodeKind kind, int a, int b) {
+    int i = hash3(kind, a, b) & (c->cap_table - 1);
+    for (; c->table[i] != -1; i = (i + 1) & (c->cap_table - 1)) {
+        Expr *e = &c->exprs[c->table[i]];
+        if (e->kind == kind && e->a == a && e->b == b)
+            break;
+    }
+    return i;
+}
+
+static Expr *lookup(Cse *c, NodeKind kind, int a, int b) {
+    if (!c->cap_table)
+        return NULL;
+    int i = table_slot(c, kind, a, b);
+    return c->table[i] == -1 ? NULL : &c->exprs[c->table[i]];
+}
+
+static Expr *insert(Cse *c, NodeKind kind, int a, int b, Node *rep) {
+    if (c->nexprs == c->cap_exprs) {
+        c->cap_exprs = c->cap_exprs ? c->cap_exprs * 2 : 256;
+        c->exprs = realloc(c->exprs, c->cap_exprs * sizeof(Expr));
+    }
+    if ((c->nexprs + 1) * 2 > c->cap_table) {
+        // re-insert oldest first: removing the newest entry then never breaks a probe chain
+        free(c->table);
+        c->cap_table = c->cap_table ? c->cap_table * 2 : 512;
+        c->table = malloc(c->cap_table * sizeof(int));
+        memset(c->table, -1, c->cap_table * sizeof(int));
+        for (int i = 0; i < c->nexprs; i++) {
+            table_put(c, i);
+        }
+    }
+    c->exprs[c->nexprs] = (Expr){kind, a, b, fresh_vn(c), rep};
+    table_put(c, c->nexprs);
+    return &c->exprs[c->nexprs++];
+}
+
+static Scope enter_scope(Cse *c) {
+    return (Scope){c->nexprs, c->nundo};
+}
+
+static void leave_scope(Cse *c, Scope s) {
+    while (c->nexprs > s.nexprs) {
+        Expr *e = &c->exprs[--c->nexprs];
+        c->table[table_slot(c, e->kind, e->a, e->b)] = -1;
+    }
+    while (c->nundo > s.nundo) {
+        Undo *u = &c->undo[--c->nundo];
+        c->vars[u->var].vn = u->vn;
+        c->vars[u->var].gen = u->gen;
+    }
+}
+
+static void kill_memory(Cse *c) {
+    c->mem_gen++;
+    if (c->addr_taken)
+        c->frame_gen++;
+}
+
+//
+// numbering
+//
+
+// reuse the value of an available expression for `node`, or make `node` available
+static int number(Cse *c, Node *node, int a, int b) {
+    Expr *e = lookup(c, node->kind, a, b);
+    if (!e)
+        return insert(c, node->kind, a, b, node)->vn;
+
+    if (e->holder && var_vn(c, e->holder) == e->vn) {
+        make_var_node(node, e->holder);
+    } else if (e->rep) {
+        // first reuse: the first occurrence becomes `temp = expr`
+        if (!e->temp) {
+            Node *copy = calloc(1, sizeof(Node));
+            *copy = *e->rep;
+            copy->next = NULL;
+            e->temp = new_temp(c->func, ".cse", c->ntemps++, e->rep->ty);
+            Node *lhs = calloc(1, sizeof(Node));
+            lhs->tok = e->rep->tok;
+            lhs->ty = e->temp->ty;
+            make_var_node(lhs, e->temp);
+            e->rep->kind = ND_ASSIGN;
+            e->rep->lhs = lhs;
+            e->rep->rhs = copy;
+        }
+        make_var_node(node, e->temp);
+    }
+    return e->vn;
+}
+
+static int leaf(Cse *c, NodeKind kind, int a) {
+    Expr *e = lookup(c, kind, a, 0);
+    return e ? e->vn : insert(c, kind, a, 0, NULL)->vn;
+}
+
+// value number of `node`, children are visited in the order codegen evaluates them
+static int value(Cse *c, Node *node) {
+    switch (node->kind) {
+    case ND_NUM:
+        return leaf(c, ND_NUM, node->value);
+    case ND_VAR:
+        return var_vn(c, node->lvar);
+    case ND_ADDR:
+        if (node->lhs->kind == ND_VAR)
+            return leaf(c, ND_ADDR, cse_var(c, node->lhs->lvar));
+        value(c, node->lhs->lhs);
+        return fresh_vn(c);
+    case ND_DEREF:
+        return number(c, node, value(c, node->lhs), c->mem_gen);
+    case ND_NEG:
+        return number(c, node, value(c, node->lhs), 0);
+    case ND_ASSIGN: {
+        if (node->lhs->kind == ND_DEREF) {
+            value(c, node->lhs->lhs);
+            value(c, node->rhs);
+            kill_memory(c);
+            return fresh_vn(c);
+        }
+        int vn = value(c, node->rhs);
+        set_var_vn(c, node->lhs->lvar, vn);
+        // loads may read the variable through a pointer
+        if (c->addr_taken)
+            c->mem_gen++;
+        for (int i = c->nexprs - 1; i >= 0; i--) {
+            if (c->exprs[i].vn == vn) {
+                if (c->exprs[i].rep && !(c->exprs[i].holder && var_vn(c, c->exprs[i].holder) == vn))
+                    c->exprs[i].holder = node->lhs->lvar;
+                break;
+            }
+        }
+        // the assignment itself is never reused, it has a side effect
+        return fresh_vn(c);
+    }
+    case ND_FUNCALL:
+        for (Node *arg = node->args; arg; arg = arg->next) {
+            value(c, arg);
+        }
+        kill_memory(c);
+        return fresh_vn(c);
+    default: {
+        // binary operators, rhs is evaluated first
+        int b = value(c, node->rhs);
+        int a = value(c, node->lhs);
+        bool commutative = node->kind == ND_ADD || node->kind == ND_MUL ||
+                           node->kind == ND_EQ || node->kind == ND_NE;
+        if (commutative && a > b) {
+            int tmp = a;
+            a = b;
+            b = tmp;
+        }
+        return number(c, node, a, b);
+    }
+    }
+}
+
+// what `node` may modify, once the code after it can't know whether it ran
+static void kill_effects(Cse *c, Node *node) {
+    for (; node; node = node->next) {
+        if (node->kind == ND_ASSIGN) {
+            if (node->lhs->kind == ND_VAR) {
+                set_var_vn(c, node->lhs->lvar, fresh_vn(c));
+                if (c->addr_taken)
+                    c->mem_gen++;
+            } else {
+                kill_memory(c);
+            }
+        }
+        if (node->kind == ND_FUNCALL)
+            kill_memory(c);
+        kill_effects(c, node->lhs);
+        kill_effects(c, node->rhs);
+        kill_effects(c, node->body);
+        kill_effects(c, node->cond);
+        kill_effects(c, node->then);
+        kill_effects(c, node->els);
+        kill_effects(c, node->init);
+        kill_effects(c, node->inc);
+        kill_effects(c, node->args);
+    }
+}
+
+static void cse_stmt(Cse *c, Node *node) {
+    switch (node->kind) {
+    case ND_EXPR_STMT:
+    case ND_RETURN:
+        value(c, node->lhs);
+        return;
+    case ND_BLOCK:
+        for (Node *n = node->body; n; n = n->next) {
+            cse_stmt(c, n);
+        }
+        return;
+    case ND_IF: {
+        value(c, node->cond);
+        Scope s = enter_scope(c);
+        cse_stmt(c, node->then);
+        leave_scope(c, s);
+        if (node->els) {
+            cse_stmt(c, node->els);
+            leave_scope(c, s);
+        }
+        kill_effects(c, node->then);
+        kill_effects(c, node->els);
+        return;
+    }
+    case ND_FOR: {
+        if (node->init)
+            cse_stmt(c, node->init);
+        kill_effects(c, node->cond);
+        kill_effects(c, node->then);
+        kill_effects(c, node->inc);
+        // the vectorizer matches the loop as it is written
+        if (is_vector_loop(node, c->addr_taken))
+            return;
+        Scope s = enter_scope(c);
+        if (node->cond)
+            value(c, node->cond);
+        cse_stmt(c, node->then);
+        if (node->inc)
+            value(c, node->inc);
+        leave_scope(c, s);
+        return;
+    }
+    default:
+        return;
+    }
+}
+
+static void eliminate_common_subexprs(Function *func) {
+    Cse c = {};
+    c.func = func;
+    c.addr_taken = has_addr(func->body);
+    cse_stmt(&c, func->body);
+
+    free(c.exprs);
+    free(c.table);
+    free_ids(&c.ids);
+    free(c.vars);
+    free(c.undo);
+}
+
+// run the AST optimizations on `func`
+void optimize(Function *func) {
+    // profile counters are numbered by the loops in the source, whatever -O does
+    if (!has_addr(func->body) && !opt_profile_generate && !opt_profile_use)
+        fold_loops(func);
+    hoist_invariants(func);
+    eliminate_common_subexprs(func);
+}
@@ -12,31 +12,35 @@
 #include "chibicc_wyj.h"
 
 // local variables list in function
-static Variable *locals;
+static _Thread_local Variable *locals;
 
 static Node *new_node(NodeKind kind, Token *tok) {
-    Node *node = (Node *)calloc(1, sizeof(Node));
+    Node *node = arena_alloc(sizeof(Node));
     node->kind = kind;
     node->tok = tok;
     return node;
 }
 
+// children are built first, so every node is typed once, as soon as it's created
 static Node *new_binary_node(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
     Node *node = new_node(kind, tok);
     node->lhs = lhs;
     node->rhs = rhs;
+    infer_type(node);
     return node;
 }
 
 static Node *new_unary_node(NodeKind kind, Node *lhs, Token *tok) {
     Node *node = new_node(kind, tok);
     node->lhs = lhs;
+    infer_type(node);
     return node;
 }
 
 static Node *new_num_node(int val, Token *tok) {
     Node *node = new_node(ND_NUM, tok);
-    node->value = 8;    // sizeof(dtype)
+    node->value = val;
+    infer_type(node);
     return node;
 }
 
@@ -45,6 +49,7 @@ static Node *new_var_node(char *name, Variable *lvar, Token *tok) {
     Node *node = new_node(ND_VAR, tok);
     node->name = name;
     node->lvar = lvar;  // local variable
+    infer_type(node);
     return node;
 }
 
@@ -53,6 +58,8 @@ static Variable *new_lvar(char *name, int len) {
     Variable *lvar = (Variable *)calloc(1, sizeof(Variable));
     // copy into new buffer: _POSIX_C_SOURCE >= 200809L
     lvar->name = strndup(name, len);
+    // variables aren't declared, all of them are int
+    lvar->ty = ty_int;
     // update global `locals`
     lvar->next = locals;
     locals = lvar;
@@ -71,29 +78,22 @@ static Variable *find_local_variable(char *name, int len) {
     return NULL;
 }
 
+// program    = (function | "{" compound_stmt)*
+// function   = ident "(" (ident ("," ident)*)? ")" "{" compound_stmt
 // stmt       = "return" expr ";" | expr_stmt | "{" compound_stmt
 //              | "if" "(" expr ")" stmt ("else" stmt)?
 //              | "for" "(" expr_stmt expr?; expr? ")" stmt
 // compound_stmt = stmt* "}"
 // expr_stmt  = expr? ";"
-// expr       = assign
-// assign     = equality ("=" assign)?
-// equality   = relational ("==" relational | "!=" relational)*
-// relational = add ("<" add | "<=" add | ">" add | ">=" add)*
-// add        = mul ("+" mul | "-" mul)*
-// mul        = unary ("*" unary | "/" unary)*
-// unary   = ("+" | "-" | "&" | "*")? primary
-// primary    = num | ident | "(" expr ")"
+// expr       = operand (binary-op operand)*, by precedence climbing:
+//              "=" < "==" "!=" < "<" "<=" ">" ">=" < "+" "-" < "*" "/" < unary
+// operand    = ("+" | "-" | "&" | "*" | "(")* primary ")"*
+// primary    = num | ident | funcall
+// funcall    = ident "(" (expr ("," expr)*)? ")"
 Node *stmt(Token **rest, Token *tok);
 Node *compound_stmt(Token **rest, Token *tok);
 Node *expr_stmt(Token **rest, Token *tok);
 Node *expr(Token **rest, Token *tok);
-Node *assign(Token **rest, Token *tok);
-static Node *equality(Token **rest, Token *tok);
-static Node *relational(Token **rest, Token *tok);
-static Node *add(Token **rest, Token *tok);
-static Node *mul(Token **rest, Token *tok);
-static Node *unary(Token **rest, Token *tok);
 static Node *primary(Token **rest, Token *tok);
 
 // stmt       = "return" expr ";" | expr_stmt | "{" compound_stmt
@@ -162,14 +162,58 @@ Node *stmt(Token **rest, Token *tok) {
     return node;
 }
 
+/**
+ * @brief panic-mode recovery: skip the rest of a statement which failed to parse
+ * 
+ * Starting from the offending token, stop after the next ";" or after a whole
+ * "{...}" block, or before a "}" which closes the enclosing block.
+ */
+static Token *sync_stmt(Token *tok, char *err_loc) {
+    while (tok->kind != TK_EOF && tok->loc < err_loc) {
+        tok = next_token(tok);
+    }
+
+    int depth = 0;
+    for (; tok->kind != TK_EOF; tok = next_token(tok)) {
+        if (depth == 0 && equal(tok, ";"))
+            return next_token(tok);
+        if (equal(tok, "{"))
+            depth++;
+        if (equal(tok, "}")) {
+            if (depth == 0)
+                return tok;
+            if (--depth == 0)
+                return next_token(tok);
+        }
+    }
+    return tok;
+}
+
 // compound_stmt = stmt* "}"
+// an error in a statement is reported, then parsing resumes at the next statement
 Node *compound_stmt(Token **rest, Token *tok) {
     Node head = {};
     Node *cur = &head;
+    jmp_buf trap;
+    jmp_buf *prev = set_recovery_trap(&trap);
+
     while (!equal(tok, "}")) {
-        cur->next = stmt(&tok, tok);
-        cur = cur->next;
+        if (tok->kind == TK_EOF) {
+            // nothing left to resync with
+            set_recovery_trap(NULL);
+            error_tok(tok, "expected '}'");
+        }
+
+        Token *start = tok;
+        if (setjmp(trap) == 0) {
+            cur->next = stmt(&tok, tok);
+            cur = cur->next;
+        } else {
+            tok = sync_stmt(start, last_error_loc());
+        }
     }
+
+    set_recovery_trap(prev);
     *rest = skip(tok, "}");
     return head.next;
 }
@@ -185,250 +229,476 @@ Node *expr_stmt(Token **rest, Token *tok) {
     return node;
 }
 
-// expr       = assign
-Node *expr(Token **rest, Token *tok) {
-    Node *node = assign(&tok, tok);
-    *rest = tok;
-    return node;
+// pointer arithmetic: `p + n` => `p + n * 8`
+static Node *new_add(Node *lhs, Node *rhs, Token *tok) {
+    // normal case: num + num
+    if (is_integer(lhs) && is_integer(rhs))
+        return new_binary_node(ND_ADD, lhs, rhs, tok);
+
+    if (lhs->ty->base && rhs->ty->base)
+        error_tok(tok, "pointer + pointer is invalid [%s:%d]", __FILE__, __LINE__);
+
+    // pointer case: num + pointer => pointer + num
+    if (rhs->ty->base) {
+        Node *tmp = rhs;
+        rhs = lhs;
+        lhs = tmp;
+    }
+    // construct mul node, which inserted to scale pointer offset unit
+    rhs = new_binary_node(ND_MUL, rhs, new_num_node(8, tok), tok);
+    return new_binary_node(ND_ADD, lhs, rhs, tok);
 }
 
-// assign     = equality ("=" assign)?
-Node *assign(Token **rest, Token *tok) {
-    Node *node = equality(&tok, tok);
-    if (equal(tok, "=")) {
-        node = new_binary_node(ND_ASSIGN, node, assign(&tok, tok->next), tok->next);
+// pointer arithmetic: `p - n` => `p - n * 8`, `p - q` => `(p - q) / 8`
+static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
+    // normal case: num - num
+    if (is_integer(lhs) && is_integer(rhs))
+        return new_binary_node(ND_SUB, lhs, rhs, tok);
+
+    // construct num node used to scale pointer unit
+    Node *num_node = new_num_node(8, tok);
+
+    // pointer case: pointer - pointer
+    if (lhs->ty->base && rhs->ty->base) {
+        Node *node = new_binary_node(ND_SUB, lhs, rhs, tok);
+        node = new_binary_node(ND_DIV, node, num_node, tok);
+        // must explicit set type, otherwise this will infered as TY_PTR
+        node->ty = ty_int;
+        return node;
     }
-    *rest = tok;
-    return node;
+
+    // pointer case: pointer - num
+    if (lhs->ty->base) {
+        rhs = new_binary_node(ND_MUL, rhs, num_node, tok);
+        return new_binary_node(ND_SUB, lhs, rhs, tok);
+    }
+
+    error_tok(tok, "num - pointer is invalid [%s:%d]", __FILE__, __LINE__);
+    return NULL;
 }
 
-// equality   = relational ("==" relational | "!=" relational)*
-static Node *equality(Token **rest, Token *tok) {
-    Node *node = relational(&tok, tok);
+// binding power of operators, the larger the tighter
+enum {
+    PREC_PAREN,     // "(": barrier, never reduced by an operator
+    PREC_ASSIGN,    // =
+    PREC_EQUALITY,  // == !=
+    PREC_RELATIONAL,// < <= > >=
+    PREC_ADD,       // + -
+    PREC_MUL,       // * /
+    PREC_UNARY,     // unary + - & *
+};
+
+// pending operator on the operator stack
+typedef struct {
+    NodeKind kind;
+    int prec;
+    bool unary;
+    Token *tok;
+} Op;
 
-    for (;;) {
-        if (equal(tok, "==")) {
-            node = new_binary_node(ND_EQ, node, relational(&tok, tok->next), tok->next);
-            continue;
-        }
-        if (equal(tok, "!=")) {
-            node = new_binary_node(ND_NE, node, relational(&tok, tok->next), tok->next);
-            continue;
+/**
+ * @brief classify a binary operator with one switch instead of a chain of `equal`
+ * 
+ * @return precedence of the operator, or -1 if `tok` isn't a binary operator
+ */
+static int binary_op(Token *tok, NodeKind *kind) {
+    if (tok->kind != TK_PUNCT)
+        return -1;
+
+    char c = tok->loc[0];
+    if (tok->len == 2) {
+        if (tok->loc[1] != '=')
+            return -1;
+        switch (c) {
+        case '=': *kind = ND_EQ; return PREC_EQUALITY;
+        case '!': *kind = ND_NE; return PREC_EQUALITY;
+        case '<': *kind = ND_LE; return PREC_RELATIONAL;
+        case '>': *kind = ND_GE; return PREC_RELATIONAL;
         }
-        break;
+        return -1;
     }
 
-    *rest = tok;
-    return node;
+    switch (c) {
+    case '=': *kind = ND_ASSIGN; return PREC_ASSIGN;
+    case '<': *kind = ND_LT; return PREC_RELATIONAL;
+    case '>': *kind = ND_GT; return PREC_RELATIONAL;
+    case '+': *kind = ND_ADD; return PREC_ADD;
+    case '-': *kind = ND_SUB; return PREC_ADD;
+    case '*': *kind = ND_MUL; return PREC_MUL;
+    case '/': *kind = ND_DIV; return PREC_MUL;
+    }
+    return -1;
 }
 
-// relational = add ("<" add | "<=" add | ">" add | ">=" add)*
-static Node *relational(Token **rest, Token *tok) {
-    Node *node = add(&tok, tok);
+// prefix operators: "+" is a no-op and never pushed
+static bool unary_op(Token *tok, NodeKind *kind) {
+    if (tok->kind != TK_PUNCT || tok->len != 1)
+        return false;
+    switch (tok->loc[0]) {
+    case '-': *kind = ND_NEG; return true;
+    case '&': *kind = ND_ADDR; return true;
+    case '*': *kind = ND_DEREF; return true;
+    }
+    return false;
+}
 
-    for (;;) {
-        if (equal(tok, "<")) {
-            node = new_binary_node(ND_LT, node, add(&tok, tok->next), tok->next);
-            continue;
-        }
-        if (equal(tok, "<=")) {
-            node = new_binary_node(ND_LE, node, add(&tok, tok->next), tok->next);
-            continue;
-        }
-        if (equal(tok, ">")) {
-            node = new_binary_node(ND_GT, node, add(&tok, tok->next), tok->next);
-            continue;
-        }
-        if (equal(tok, ">=")) {
-            node = new_binary_node(ND_GE, node, add(&tok, tok->next), tok->next);
-            continue;
-        }
-        break;
+// growable stack, starts in a caller-provided buffer
+typedef struct {
+    void *data;
+    int len;
+    int cap;
+    int size;
+    bool heap;
+} Stack;
+
+static void *stack_push(Stack *st) {
+    if (st->len == st->cap) {
+        void *data = malloc(st->cap * 2 * st->size);
+        memcpy(data, st->data, st->cap * st->size);
+        if (st->heap)
+            free(st->data);
+        st->data = data;
+        st->cap *= 2;
+        st->heap = true;
     }
+    return (char *)st->data + st->size * st->len++;
+}
 
-    *rest = tok;
-    return node;
+static void stack_free(Stack *st) {
+    if (st->heap)
+        free(st->data);
+}
 
+// pop the top operator and apply it to the operand stack
+static void reduce(Stack *ops, Stack *vals) {
+    Op *op = &((Op *)ops->data)[--ops->len];
+    Node **v = vals->data;
+
+    if (op->unary) {
+        v[vals->len - 1] = new_unary_node(op->kind, v[vals->len - 1], op->tok);
+        return;
+    }
+
+    Node *rhs = v[--vals->len];
+    Node *lhs = v[vals->len - 1];
+    Node *node;
+    if (op->kind == ND_ADD)
+        node = new_add(lhs, rhs, op->tok);
+    else if (op->kind == ND_SUB)
+        node = new_sub(lhs, rhs, op->tok);
+    else
+        node = new_binary_node(op->kind, lhs, rhs, op->tok);
+    v[vals->len - 1] = node;
 }
 
-// add        = mul ("+" mul | "-" mul)*
-static Node *add(Token **rest, Token *tok) {
-    Node *node = mul(&tok, tok);
+// funcall = ident "(" (expr ("," expr)*)? ")"
+static Node *funcall(Token **rest, Token *tok) {
+    Node *node = new_node(ND_FUNCALL, tok);
+    node->funcname = arena_strndup(tok->loc, tok->len);
 
-    for (;;) {
-        if (equal(tok, "+")) {
-            Node *rnode = mul(&tok, tok->next);
+    Node head = {};
+    Node *cur = &head;
+    int nargs = 0;
+    tok = tok->next->next;
+    while (!equal(tok, ")")) {
+        if (nargs > 0)
+            tok = skip(tok, ",");
+        if (++nargs > MAX_REG_ARGS)
+            error_tok(tok, "too many arguments, at most %d are supported", MAX_REG_ARGS);
+        cur = cur->next = expr(&tok, tok);
+    }
+    node->args = head.next;
+    infer_type(node);
+    *rest = skip(tok, ")");
+    return node;
+}
 
-            // update node type
-            add_type(node);
-            add_type(rnode);
+// primary    = num | ident | funcall
+static Node *primary(Token **rest, Token *tok) {
+    if (tok->kind == TK_NUM) {
+        Node *node = new_num_node(tok->value, tok);
+        *rest = tok->next;
+        return node;
+    }
 
-            // normal case: num + num
-            if (is_integer(node) && is_integer(rnode)) {
-                node = new_binary_node(ND_ADD, node, rnode, tok);
-                continue;
-            }
+    if (tok->kind == TK_IDENT && equal(tok->next, "("))
+        return funcall(rest, tok);
 
-            if (node->ty->base && rnode->ty->base) {
-                error_tok(tok, "pointer + pointer is invalid [%s:%d]", __FILE__, __LINE__);
-            }
-            
-            // pointer case: num + pointer => pointer + num
-            if (rnode->ty->base) {
-                Node *tmp = rnode;
-                rnode = node;
-                node = tmp;
-            }
-            // construct mul node, which inserted to scale pointer offset unit
-            rnode = new_binary_node(ND_MUL, rnode, new_num_node(8, tok), tok);
-            node = new_binary_node(ND_ADD, node, rnode, tok);
-            continue;
+    if (tok->kind == TK_IDENT) {
+        Variable *lvar = find_local_variable(tok->loc, tok->len);
+        if (!lvar) {
+            // new local variable
+            lvar = new_lvar(tok->loc, tok->len);
         }
-        
-        if (equal(tok, "-")) {
-            Node *rnode = mul(&tok, tok->next);
+        Node *node = new_var_node(tok->loc, lvar, tok);
+        *rest = tok->next;
+        return node;
+    }
+
+    error_tok(tok, "expected an expression [%s:%d]", __FILE__, __LINE__);
+    return NULL;
+}
 
-            // update node type
-            add_type(node);
-            add_type(rnode);
+/**
+ * @brief expr = operand (binary-op operand)*
+ *        operand = ("+" | "-" | "&" | "*" | "(")* primary ")"*
+ * 
+ * Precedence climbing with explicit operand/operator stacks instead of one C
+ * function per precedence level, so a primary costs a single call and neither
+ * long operator chains nor deep parentheses grow the C stack. "=" is the only
+ * right-associative operator; "(" is pushed as a barrier which only the
+ * matching ")" removes.
+ */
+Node *expr(Token **rest, Token *tok) {
+    Op op_buf[32];
+    Node *val_buf[32];
+    Stack ops = {op_buf, 0, 32, sizeof(Op), false};
+    Stack vals = {val_buf, 0, 32, sizeof(Node *), false};
+    int parens = 0;
 
-            // normal case: num - num
-            if (is_integer(node) && is_integer(rnode)) {
-                node = new_binary_node(ND_SUB, node, rnode, tok->next);
+    for (;;) {
+        // prefix operators and open parentheses
+        for (;;) {
+            NodeKind kind;
+            if (equal(tok, "+")) {
+                tok = tok->next;
                 continue;
             }
-
-            // construct num node used to scale pointer unit
-            Node *num_node = new_num_node(8, tok);
-
-            // pointer case: pointer - pointer
-            if (node->ty->base && rnode->ty->base) {
-                node = new_binary_node(ND_SUB, node, rnode, tok);
-                node = new_binary_node(ND_DIV, node, num_node, tok);
-                // must explicit set type, otherwise this will infered as TY_PTR
-                node->ty = ty_int;
+            if (unary_op(tok, &kind)) {
+                *(Op *)stack_push(&ops) = (Op){kind, PREC_UNARY, true, tok};
+                tok = tok->next;
                 continue;
             }
-
-            // pointer case: pointer - num
-            if (node->ty->base) {
-                rnode = new_binary_node(ND_MUL, rnode, num_node, tok);
-                node = new_binary_node(ND_SUB, node, rnode, tok);
+            if (equal(tok, "(")) {
+                *(Op *)stack_push(&ops) = (Op){ND_NUM, PREC_PAREN, false, tok};
+                parens++;
+                tok = tok->next;
                 continue;
             }
-
-            error_tok(tok, "num - pointer is invalid [%s:%d]", __FILE__, __LINE__);
+            break;
         }
-        break;
-    }
 
-    *rest = tok;    // update the newest token pointer
-    return node;
-}
+        *(Node **)stack_push(&vals) = primary(&tok, tok);
 
-// mul     = unary ("*" unary | "/" unary)*
-static Node *mul(Token **rest, Token *tok) {
-    Node *node = unary(&tok, tok);
-
-    for (;;) {
-        if (equal(tok, "*")) {
-            node = new_binary_node(ND_MUL, node, unary(&tok, tok->next), tok->next);
-            continue;
+        // close parentheses
+        while (parens > 0 && equal(tok, ")")) {
+            while (((Op *)ops.data)[ops.len - 1].prec != PREC_PAREN) {
+                reduce(&ops, &vals);
+            }
+            ops.len--;
+            parens--;
+            tok = tok->next;
         }
-        
-        if (equal(tok, "/")) {
-            node = new_binary_node(ND_DIV, node, unary(&tok, tok->next), tok->next);
-            continue;
+
+        NodeKind kind;
+        int prec = binary_op(tok, &kind);
+        if (prec < 0)
+            break;
+
+        // left-associative operators reduce equal precedence, "=" doesn't
+        while (ops.len > 0) {
+            Op *top = &((Op *)ops.data)[ops.len - 1];
+            if (top->prec < prec || (top->prec == prec && kind == ND_ASSIGN))
+                break;
+            reduce(&ops, &vals);
         }
-        break;
+        *(Op *)stack_push(&ops) = (Op){kind, prec, false, tok};
+        tok = tok->next;
+    }
+
+    if (parens > 0)
+        skip(tok, ")");
+    while (ops.len > 0) {
+        reduce(&ops, &vals);
     }
 
+    Node *node = ((Node **)vals.data)[0];
+    stack_free(&ops);
+    stack_free(&vals);
     *rest = tok;
     return node;
 }
 
+static char *get_ident(Token *tok) {
+    if (tok->kind != TK_IDENT)
+        error_tok(tok, "expected an identifier");
+    return strndup(tok->loc, tok->len);
+}
 
-// unary   = ("+" | "-" | "&" | "*")? primary
-static Node *unary(Token **rest, Token *tok) {
-    Node *node = NULL;
-    if (equal(tok, "+")) {
-        node = unary(&tok, tok->next);
-        *rest = tok;
-        return node;
-    }
-
-    if (equal(tok, "-")) {
-        node = new_unary_node(ND_NEG, unary(&tok, tok->next), tok->next);
-        *rest = tok;
-        return node;
-    }
-
-    if (equal(tok, "&")) {
-        node = new_unary_node(ND_ADDR, unary(&tok, tok->next), tok->next);
-        // node->ty->base = true;
-        add_type(node);
-        *rest = tok;
-        return node;
-    }
+// function header: ident "(" (ident ("," ident)*)? ")", or nothing before a bare "{"
+static Function *function_header(Token **rest, Token *tok) {
+    Function *func = calloc(1, sizeof(Function));
+    locals = NULL;
 
-    if (equal(tok, "*")) {
-        node = new_unary_node(ND_DEREF, unary(&tok, tok->next), tok->next);
-        *rest = tok;
-        return node;
+    if (equal(tok, "{")) {
+        func->name = "main";
+    } else {
+        func->name = get_ident(tok);
+        tok = skip(tok->next, "(");
+        func->params = calloc(MAX_REG_ARGS, sizeof(Variable *));
+        while (!equal(tok, ")")) {
+            if (func->nparams > 0)
+                tok = skip(tok, ",");
+            if (func->nparams == MAX_REG_ARGS)
+                error_tok(tok, "too many parameters, at most %d are supported", MAX_REG_ARGS);
+            if (tok->kind != TK_IDENT || find_local_variable(tok->loc, tok->len))
+                error_tok(tok, "expected a parameter name");
+            func->params[func->nparams++] = new_lvar(tok->loc, tok->len);
+            tok = tok->next;
+        }
+        tok = skip(tok, ")");
+        if (!equal(tok, "{"))
+            error_tok(tok, "expected '{'");
     }
-    
-    node = primary(&tok, tok);
     *rest = tok;
-    return node;
+    return func;
+}
+
+// function   = ident "(" (ident ("," ident)*)? ")" "{" compound_stmt
+// a bare "{" compound_stmt at top level is the body of `main`
+static Function *function(Token **rest, Token *tok) {
+    Function *func = function_header(&tok, tok);
+    func->body = stmt(rest, tok);
+    // `locals` must after `body` calculated
+    func->locals = locals;
+    return func;
 }
 
-// // unary   = ("+" | "-")? primary
-// static Node *unary(Token **rest, Token *tok) {
-//     if (equal(tok, "+")) {
-//         return unary(rest, tok->next);
-//     }
+// functions parsed so far from the current input
+static _Thread_local Function *program;
+static _Thread_local Function *program_tail;
 
-//     if (equal(tok, "-")) {
-//         return new_unary_node(ND_NEG, unary(rest, tok->next));
-//     }
-    
-//     return primary(rest, tok);
-// }
+// names of `program`, open addressing
+static _Thread_local char **func_names;
+static _Thread_local int func_names_cap;
+static _Thread_local int func_names_cnt;
 
-// primary    = num | ident | "(" expr ")"
-static Node *primary(Token **rest, Token *tok) {
-    if (tok->kind == TK_NUM) {
-        Node *node = new_node(ND_NUM, tok);
-        node->value = tok->value;
-        *rest = tok->next;
-        return node;
+static uint64_t hash_name(char *name) {
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (char *p = name; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
     }
+    return h;
+}
 
-    if (tok->kind == TK_IDENT) {
-        Variable *lvar = find_local_variable(tok->loc, tok->len);
-        if (!lvar) {
-            // new local variable
-            lvar = new_lvar(tok->loc, tok->len);
+// false if a function of this name was already defined
+static bool declare_function(char *name) {
+    if ((func_names_cnt + 1) * 2 > func_names_cap) {
+        char **old = func_names;
+        int old_cap = func_names_cap;
+        func_names_cap = old_cap ? old_cap * 2 : 64;
+        func_names = calloc(func_names_cap, sizeof(char *));
+        func_names_cnt = 0;
+        for (int i = 0; i < old_cap; i++) {
+            if (old[i])
+                declare_function(old[i]);
         }
-        Node *node = new_var_node(tok->loc, lvar, tok);
-        *rest = tok->next;
-        return node;
+        free(old);
     }
 
-    if (equal(tok, "(")) {
-        Node *node = expr(&tok, tok->next);
-        *rest = skip(tok, ")");
-        return node;
+    int i = hash_name(name) & (func_names_cap - 1);
+    for (; func_names[i]; i = (i + 1) & (func_names_cap - 1)) {
+        if (!strcmp(func_names[i], name))
+            return false;
     }
+    func_names[i] = name;
+    func_names_cnt++;
+    return true;
+}
 
-    error_tok(tok, "expected an expression [%s:%d]", __FILE__, __LINE__);
+void parse_start(void) {
+    program = program_tail = NULL;
+    free(func_names);
+    func_names = NULL;
+    func_names_cap = func_names_cnt = 0;
+}
+
+/**
+ * @brief parse one top-level item, e.g. a function of a pipelined input while
+ *        the tokens after it are still being read
+ * 
+ * @return Function* the new function, which is also appended to the program
+ */
+Function *parse_toplevel(Token **rest, Token *tok) {
+    Token *start = tok;
+    Function *func = function(rest, tok);
+    if (!declare_function(func->name))
+        error_tok(start, "redefinition of function '%s'", func->name);
+    if (program_tail)
+        program_tail = program_tail->next = func;
+    else
+        program = program_tail = func;
+    return func;
 }
 
 Function *parse(Token *tok) {
-    // wrapper of Function
-    Function *func = malloc(sizeof(Function));
-    func->body = stmt(&tok, tok);
-    // `locals` must after `body` calculated
+    parse_start();
+    while (tok->kind != TK_EOF) {
+        parse_toplevel(&tok, tok);
+    }
+    // every error was reported, don't generate code
+    if (has_errors())
+        fatal();
+    return program;
+}
+
+//
+// Streaming: a function header, then one statement at a time
+//
+
+// prescan of a body: every identifier which isn't called is a local, in order of appearance
+static void prescan_token(void *ctx, Token *tok, Token *next) {
+    Function *func = ctx;
+    if (equal(tok, "&"))
+        func->addr_taken = true;
+    if (tok->kind != TK_IDENT)
+        return;
+    if (next && equal(next, "("))
+        func->has_call = true;
+    else if (!find_local_variable(tok->loc, tok->len))
+        new_lvar(tok->loc, tok->len);
+}
+
+/**
+ * @brief parse the header tokens of the next function, up to its "{", and find its locals
+ * 
+ * @return Function* the function without a body: its statements come from `parse_stream_stmt`
+ */
+Function *parse_stream_function(Token *tok) {
+    Token *start = tok;
+    Function *func = function_header(&tok, tok);
+    if (!declare_function(func->name))
+        error_tok(start, "redefinition of function '%s'", func->name);
+    stream_prescan(prescan_token, func);
     func->locals = locals;
     return func;
-}
\ No newline at end of file
+}
+
+// one statement of the current function, NULL if it was reported as an error
+Node *parse_stream_stmt(Token *tok) {
+    jmp_buf trap;
+    jmp_buf *prev = set_recovery_trap(&trap);
+    if (setjmp(trap) != 0) {
+        set_recovery_trap(prev);
+        return NULL;
+    }
+    Node *node = stmt(&tok, tok);
+    if (tok->kind != TK_EOF)
+        error_tok(tok, "expected the end of the statement");
+    set_recovery_trap(prev);
+    return node;
+}
+
+// the function was generated, free what outlived its statements
+void parse_stream_end(Function *func) {
+    for (Variable *var = func->locals; var;) {
+        Variable *next = var->next;
+        free(var->name);
+        free(var);
+        var = next;
+    }
+    free(func->params);
+    free(func);
+    locals = NULL;
+}
@@ -0,0 +1,124 @@
+/**
+ * @file pool.c
+ * @author wuyangjun (wuyangjun21@163.com)
+ * @brief work-stealing thread pool: every worker owns a deque of jobs, pops from its bottom,
+ *        and steals from the top of the others' deques once its own deque runs dry
+ * @version 0.1
+ * @date 2022-08-30
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "chibicc_wyj.h"
+#include <pthread.h>
+
+// Job deque owned by a worker
+typedef struct {
+    pthread_mutex_t lock;
+    int *jobs;      // job indices
+    int top;        // thieves take from here
+    int bottom;     // owner takes from here, [top, bottom) are pending
+} Deque;
+
+typedef struct {
+    Deque *deques;
+    int nworkers;
+    void (*fn)(void *ctx, int job);
+    void *ctx;
+} Pool;
+
+typedef struct {
+    Pool *pool;
+    int id;
+    pthread_t thread;
+} Worker;
+
+// owner end: LIFO
+static bool pop_bottom(Deque *dq, int *job) {
+    bool ok = false;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->top < dq->bottom) {
+        *job = dq->jobs[--dq->bottom];
+        ok = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+// thief end: FIFO
+static bool steal_top(Deque *dq, int *job) {
+    bool ok = false;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->top < dq->bottom) {
+        *job = dq->jobs[dq->top++];
+        ok = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+static void *worker_main(void *arg) {
+    Worker *w = arg;
+    Pool *pool = w->pool;
+    int job;
+
+    for (;;) {
+        if (pop_bottom(&pool->deques[w->id], &job)) {
+            pool->fn(pool->ctx, job);
+            continue;
+        }
+
+        // jobs never spawn jobs, so all deques empty means all work is taken
+        bool stolen = false;
+        for (int i = 1; i < pool->nworkers && !stolen; i++) {
+            stolen = steal_top(&pool->deques[(w->id + i) % pool->nworkers], &job);
+        }
+        if (!stolen)
+            return NULL;
+        pool->fn(pool->ctx, job);
+    }
+}
+
+void pool_run(int nthreads, int njobs, void (*fn)(void *ctx, int job), void *ctx) {
+    if (nthreads > njobs)
+        nthreads = njobs;
+
+    // nothing to share, run inline
+    if (nthreads <= 1) {
+        for (int i = 0; i < njobs; i++) {
+            fn(ctx, i);
+        }
+        return;
+    }
+
+    Pool pool = {calloc(nthreads, sizeof(Deque)), nthreads, fn, ctx};
+    for (int i = 0; i < nthreads; i++) {
+        Deque *dq = &pool.deques[i];
+        pthread_mutex_init(&dq->lock, NULL);
+        dq->jobs = calloc(njobs / nthreads + 1, sizeof(int));
+    }
+    // deal jobs round-robin, so the first jobs start first
+    for (int i = njobs - 1; i >= 0; i--) {
+        Deque *dq = &pool.deques[i % nthreads];
+        dq->jobs[dq->bottom++] = i;
+    }
+
+    Worker *workers = calloc(nthreads, sizeof(Worker));
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].pool = &pool;
+        workers[i].id = i;
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0)
+            error("pthread_create failed");
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].jobs);
+    }
+    free(pool.deques);
+    free(workers);
+}
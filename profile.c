@@ -0,0 +1,111 @@
+/**
+ * @file profile.c
+ * @author wuyangjun (wuyangjun21@163.com)
+ * @brief profile-guided optimization: load the branch counters written by a program built
+ *        with -fprofile-generate, codegen of -fprofile-use looks them up by (function, counter)
+ * @version 0.1
+ * @date 2022-09-02
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "chibicc_wyj.h"
+
+// file layout, every run of every instrumented unit appends one block:
+//   magic | uint64_t block size | records
+// record: uint64_t count | uint64_t counter id | function name, NUL-terminated, padded to 8 bytes
+
+typedef struct {
+    char *func;
+    int id;
+    uint64_t count;
+} ProfEntry;
+
+// (function, counter) => count, open addressing, read-only once loaded
+static ProfEntry *entries;
+static int cap;
+static int cnt;
+
+static uint64_t hash_key(char *func, int id) {
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (char *p = func; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+    }
+    return (h ^ id) * 0x100000001b3ULL;
+}
+
+static ProfEntry *find(char *func, int id) {
+    int i = hash_key(func, id) & (cap - 1);
+    while (entries[i].func && (entries[i].id != id || strcmp(entries[i].func, func)))
+        i = (i + 1) & (cap - 1);
+    return &entries[i];
+}
+
+static void add_count(char *func, int id, uint64_t count) {
+    if ((cnt + 1) * 2 > cap) {
+        ProfEntry *old = entries;
+        int old_cap = cap;
+        cap = cap ? cap * 2 : 256;
+        entries = calloc(cap, sizeof(ProfEntry));
+        cnt = 0;
+        for (int i = 0; i < old_cap; i++) {
+            if (old[i].func)
+                add_count(old[i].func, old[i].id, old[i].count);
+        }
+        free(old);
+    }
+
+    ProfEntry *e = find(func, id);
+    if (!e->func) {
+        *e = (ProfEntry){func, id, 0};
+        cnt++;
+    }
+    e->count += count;
+}
+
+/**
+ * @brief read a profile, counts of the same counter from several runs add up
+ *
+ * Function names point into the mapping of the file, which is never unmapped.
+ */
+void load_profile(char *path) {
+    size_t len;
+    char *buf = read_file(path, &len, NULL);
+    char *end = buf + len;
+
+    for (char *p = buf; p < end;) {
+        uint64_t size;
+        if (end - p < 16 || memcmp(p, PROFILE_MAGIC, 8))
+            error("invalid profile %s: bad magic", path);
+        memcpy(&size, p + 8, 8);
+        if (size < 16 || size > end - p || size % 8)
+            error("invalid profile %s: bad block size", path);
+
+        char *block_end = p + size;
+        for (char *r = p + 16; r < block_end;) {
+            uint64_t count, id;
+            char *name = r + 16;
+            char *nul = name < block_end ? memchr(name, '\0', block_end - name) : NULL;
+            if (!nul)
+                error("invalid profile %s: truncated record", path);
+            memcpy(&count, r, 8);
+            memcpy(&id, r + 8, 8);
+            add_count(name, id, count);
+            r = name + (nul - name + 1 + 7) / 8 * 8;
+        }
+        p = block_end;
+    }
+}
+
+// count of counter `id` of `func`, false if the profile doesn't know it
+bool profile_count(char *func, int id, uint64_t *count) {
+    if (!cap)
+        return false;
+    ProfEntry *e = find(func, id);
+    if (!e->func)
+        return false;
+    *count = e->count;
+    return true;
+}
@@ -4,7 +4,7 @@ assert() {
     expected="$1"
     input="$2"
 
-    ./chibicc-wyj "$input" > tmp.s || exit
+    echo "$input" | ./chibicc-wyj -o tmp.s - || exit
     gcc -g -static -o tmp tmp.s
     ./tmp
     actual="$?"
@@ -17,6 +17,10 @@ assert() {
     fi
 }
 
+# outputs which aren't throwaway sources or assembly stay out of the tree
+tmp_dir=$(mktemp -d) || exit
+trap 'rm -rf "$tmp_dir"' EXIT
+
 # integer
 assert 0 '{ return 0; }'
 assert 42 '{ return 42; }'
@@ -110,4 +114,404 @@ assert 7 '{ x=3; y=5; *(&x+1)=7; return y; }'
 assert 7 '{ x=3; y=5; *(&y-2+1)=7; return x; }'
 assert 5 '{ x=3; return (&x+2)-&x+3; }'
 
+# stack slots shared by variables with disjoint live ranges
+assert 5 '{ a=1; b=a+1; c=b+1; d=c+1; e=d+1; return e; }'
+assert 11 '{ a=1; b=a+1; c=b+1; d=c+1; e=d+1; i=0; for (j=0; j<3; j=j+1) { t=j*2; i=i+t; } return e+i; }'
+assert 6 '{ s=0; for (i=0; i<3; i=i+1) { if (i==0) t=1; s=s+t; t=t+1; } return s; }'
+assert 7 '{ a=3; if (a) { b=4; a=a+b; } else { c=5; a=a+c; } return a; }'
+
+# operator precedence / associativity
+assert 7 '{ return 1+2*3; }'
+assert 1 '{ return 10-4-3-2; }'
+assert 2 '{ return 16/4/2; }'
+assert 1 '{ return 1<2==1; }'
+assert 9 '{ a=b=c=3; return a+b+c; }'
+assert 3 '{ return ((((((((((3)))))))))); }'
+assert 6 '{ x=2; return -(-(x))*3; }'
+
+# nodes are typed as they are built: `*y` is typed even inside `+`
+assert 4 '{ x=3; y=&x; return *y+1; }'
+
+# function definition and call, arguments in registers
+assert 3 'ret3() { return 3; } main() { return ret3(); }'
+assert 21 'add6(a, b, c, d, e, f) { return a+b+c+d+e+f; } main() { return add6(1, 2, 3, 4, 5, 6); }'
+assert 7 'sub2(a, b) { return a-b; } main() { x=9; return sub2(x, 2); }'
+assert 55 'fib(n) { if (n<=1) return n; return fib(n-1)+fib(n-2); } main() { return fib(10); }'
+assert 10 'id(x) { return x; } main() { return id(1)+id(2)*id(3)+id(id(3)); }'
+assert 5 'five() { return 5; } { return five(); }'
+
+# a leaf function without locals keeps no frame
+echo 'ret3() { return 3; } main() { return ret3(); }' | ./chibicc-wyj -o tmp.s - || exit
+if sed -n '/^ret3:/,/ret$/p' tmp.s | grep -q rbp; then
+    echo "frameless leaf function => rbp unexpected"; exit 1
+fi
+echo "frameless leaf function => OK"
+
+# large input from a mapped file, bigger than one command line argument may be
+{ echo '{ a=0;'; for i in $(seq 20000); do echo 'a=a+1;'; done; echo 'return a; }'; } > tmp.c
+./chibicc-wyj -o tmp.s tmp.c || exit
+gcc -static -o tmp tmp.s
+./tmp
+actual="$?"
+if [ "$actual" != 32 ]; then
+    echo "large input => 32 expected, but got $actual"
+    exit 1
+fi
+echo "large input => OK"
+
+# an object file from stdin needs '-o <file>', `as` can't write to stdout
+echo '{ return 1; }' | ./chibicc-wyj -c - 2> tmp.err && { echo "error expected"; exit 1; }
+if ! grep -q 'cannot write an object file to stdout' tmp.err; then
+    echo "object file to stdout => error expected"; cat tmp.err; exit 1
+fi
+echo "object file from stdin => OK"
+
+# machine-generated expression: deep parentheses and a long operator chain
+{ echo -n '{ return '; for i in $(seq 5000); do echo -n '('; done; echo -n 1; for i in $(seq 5000); do echo -n ')'; done
+  for i in $(seq 5000); do echo -n '+1'; done; echo '; }'; } > tmp.c
+./chibicc-wyj -o tmp.s tmp.c || exit
+gcc -static -o tmp tmp.s
+./tmp
+actual="$?"
+if [ "$actual" != 137 ]; then
+    echo "deep expression => 137 expected, but got $actual"
+    exit 1
+fi
+echo "deep expression => OK"
+
+# multiple files compiled in parallel, each file has its own output
+echo '{ return 1; }' > tmp1.c
+echo '{ return 2; }' > tmp2.c
+echo '{ return 3; }' > tmp3.c
+./chibicc-wyj -j 2 tmp1.c tmp2.c tmp3.c || exit
+for i in 1 2 3; do
+    gcc -static -o tmp tmp$i.s
+    ./tmp
+    actual="$?"
+    if [ "$actual" != "$i" ]; then
+        echo "tmp$i.c => $i expected, but got $actual"
+        exit 1
+    fi
+done
+
+# label numbers restart with every file, whatever the thread compiled before
+echo '{ a = 3; if (a > 1) a = 2; else a = 5; return a; }' > tmp1.c
+cp tmp1.c tmp2.c
+./chibicc-wyj -j 1 tmp1.c tmp2.c || exit
+cmp -s tmp1.s tmp2.s || { echo "same file, different labels"; exit 1; }
+echo "parallel files => OK"
+
+# diagnostics keep the order of command line
+echo '{ return 1 }' > tmp2.c
+echo '{ return 2 }' > tmp3.c
+./chibicc-wyj -j 3 tmp1.c tmp2.c tmp3.c 2> tmp.err && { echo "error expected"; exit 1; }
+if [ "$(grep -c expected tmp.err)" != 2 ] || ! head -1 tmp.err | grep -q '^tmp2.c:1:'; then
+    echo "diagnostics order mismatch"; cat tmp.err; exit 1
+fi
+echo "parallel diagnostics => OK"
+
+# diagnostics: file:line:col, and one run reports every bad statement
+printf '{\n  a = 1;\n  b = ;\n  if (a) { c = 2 d; }\n  e = 3;\n  return 1 }\n' > tmp1.c
+./chibicc-wyj -o tmp.s tmp1.c 2> tmp.err && { echo "error expected"; exit 1; }
+if [ "$(grep -c ': error: ' tmp.err)" != 3 ] || ! grep -q '^tmp1.c:4:18: error: ' tmp.err; then
+    echo "diagnostics mismatch"; cat tmp.err; exit 1
+fi
+./chibicc-wyj -ferror-limit=2 -o tmp.s tmp1.c 2> tmp.err
+if [ "$(grep -c ': error: ' tmp.err)" != 2 ] || ! grep -q 'too many errors' tmp.err; then
+    echo "error limit mismatch"; cat tmp.err; exit 1
+fi
+echo "diagnostics => OK"
+
+# vectorized loops (-O): results match the scalar loop, also with overlapping pointers
+cat > tmp1.c <<'EOF2'
+vadd(a, b, c, n) { for (i=0; i<n; i=i+1) *(c+i*8) = *(a+i*8) + *(b+i*8) - 3; return 0; }
+vsub(a, b, c, n) { k=7; for (i=0; i<=n; i=i+1) { *(c+i*8) = -(*(a+i*8) - *(b+i*8) + k); } return 0; }
+EOF2
+cat > tmp2.c <<'EOF2'
+long vadd(long a, long b, long c, long n);
+long vsub(long a, long b, long c, long n);
+int main() {
+    long a[37], b[37], c[37], x[37], zero[37] = {0};
+    for (int i = 0; i < 37; i++) { a[i] = i; b[i] = 100 * i; x[i] = 1000; }
+    vadd((long)a, (long)b, (long)c, 37);
+    for (int i = 0; i < 37; i++) if (c[i] != a[i] + b[i] - 3) return 1;
+    // c = a + 1 element: every iteration reads what the previous one wrote
+    vadd((long)x, (long)zero, (long)(x + 1), 36);
+    for (int i = 0; i < 37; i++) if (x[i] != 1000 - 3 * i) return 2;
+    // in place, inclusive bound
+    vsub((long)a, (long)b, (long)a, 36);
+    for (int i = 0; i < 37; i++) if (a[i] != -(i - 100 * i + 7)) return 3;
+    return 0;
+}
+EOF2
+flags_list=("-O")
+grep -qw avx2 /proc/cpuinfo && flags_list+=("-O -mavx2")
+for flags in "${flags_list[@]}"; do
+    ./chibicc-wyj $flags -o tmp.s tmp1.c || exit
+    grep -q 'paddq' tmp.s || { echo "$flags: loop not vectorized"; exit 1; }
+    gcc -static -o tmp tmp.s tmp2.c
+    ./tmp
+    actual="$?"
+    if [ "$actual" != 0 ]; then
+        echo "vectorized loop $flags => check $actual failed"
+        exit 1
+    fi
+    # in place: the vector loop runs, a jump to the scalar loop would abort
+    grep -q '^\.L\.VBEGIN\.' tmp.s || { echo "$flags: no vector loop"; exit 1; }
+    sed -E 's/^(  j[a-ln-z]+) \.L\.BEGIN\.[0-9]+$/\1 abort/' tmp.s > tmp1.s
+    echo 'int vsub(long, long, long, long); int main() { long a[37], b[37];
+          for (int i = 0; i < 37; i++) { a[i] = i; b[i] = 100 * i; }
+          vsub((long)a, (long)b, (long)a, 36);
+          for (int i = 0; i < 37; i++) if (a[i] != -(i - 100 * i + 7)) return 1;
+          return 0; }' > tmp3.c
+    gcc -static -o tmp tmp1.s tmp3.c
+    ./tmp
+    actual="$?"
+    if [ "$actual" != 0 ]; then
+        echo "vectorized loop $flags in place => 0 expected, but got $actual"
+        exit 1
+    fi
+done
+echo "vectorized loops => OK"
+
+# profile-guided optimization: the instrumented program writes a profile, which moves the cold branch out of line
+echo 'main() { j=0; for (i=0; i<100; i=i+1) { if (i==50) j=j+100; else j=j+1; } return j; }' > tmp1.c
+prof="$tmp_dir/prof"
+./chibicc-wyj -fprofile-generate="$prof" -o tmp.s tmp1.c || exit
+gcc -static -o tmp tmp.s
+./tmp
+[ "$?" = 199 ] && [ -s "$prof" ] || { echo "instrumented program => 199 and a profile expected"; exit 1; }
+./chibicc-wyj -fprofile-use="$prof" -o tmp.s tmp1.c || exit
+if ! sed -n '/ret$/,$p' tmp.s | grep -q '^.L.THEN'; then
+    echo "profile-guided layout => cold branch after ret expected"; exit 1
+fi
+gcc -static -o tmp tmp.s
+./tmp
+actual="$?"
+if [ "$actual" != 199 ]; then
+    echo "profile-guided build => 199 expected, but got $actual"
+    exit 1
+fi
+echo "profile-guided optimization => OK"
+
+# debug info (-g): addresses resolve to source lines, every function has unwind info
+printf 'ret3() {\n  return 3;\n}\nmain() {\n  x = 1;\n  for (i=0; i<3; i=i+1)\n    x = x + ret3();\n  return x;\n}\n' > tmp1.c
+./chibicc-wyj -g -o tmp.s tmp1.c || exit
+gcc -static -o tmp tmp.s
+./tmp
+[ "$?" = 10 ] || { echo "debug build => 10 expected"; exit 1; }
+for f in ret3:2 main:5; do
+    line=$(addr2line -e tmp $(nm tmp | awk -v f=${f%:*} '$3 == f { print $1 }'))
+    if [ "${line##*:}" != "${f#*:}" ]; then
+        echo "addr2line ${f%:*} => tmp1.c:${f#*:} expected, but got $line"
+        exit 1
+    fi
+done
+[ "$(grep -c cfi_startproc tmp.s)" = 2 ] || { echo "debug build => CFI for each function expected"; exit 1; }
+# the file name is escaped in `.file`
+odd_name="$tmp_dir/q\"x\\y.c"
+echo '{ return 3; }' > "$odd_name"
+./chibicc-wyj -g -c -o tmp.o "$odd_name" || { echo "debug build of $odd_name => assembled object expected"; exit 1; }
+echo "debug info => OK"
+
+# common subexpression elimination (-O): a value is computed once while nothing it reads changes
+echo 'main() { a=3; b=4; c=5; x=a*b+c; y=a*b+c; return x+y; }' > tmp1.c
+./chibicc-wyj -O -o tmp.s tmp1.c || exit
+[ "$(grep -c imul tmp.s)" = 1 ] || { echo "cse => one imul expected"; exit 1; }
+while IFS='|' read -r expected input; do
+    echo "$input" | ./chibicc-wyj -O -o tmp.s - || exit
+    gcc -static -o tmp tmp.s
+    ./tmp
+    actual="$?"
+    if [ "$actual" != "$expected" ]; then
+        echo "-O $input => $expected expected, but got $actual"
+        exit 1
+    fi
+done <<'EOF'
+34|main() { a=3; b=4; c=5; x=a*b+c; y=a*b+c; return x+y; }
+9|main() { a=1; b=2; x=a+b; y=b+a; z=a+b; return x+y+z; }
+32|main() { a=3; b=4; x=a*b; a=5; y=a*b; return x+y; }
+25|main() { a=3; b=4; x=a*b; x=x+1; y=a*b; return x+y; }
+20|main() { a=3; b=4; p=&a; x=a*b; *p=2; y=a*b; return x+y; }
+6|f(p) { *p=3; return 0; } main() { a=1; p=&a; x=*p; f(p); y=*p; return x+y+2; }
+10|main() { x=3; y=5; z=*(&x+1); *(&x+1)=7; w=*(&x+1); return z+w-2; }
+28|main() { a=3; b=4; x=a*b; if (x>5) { y=a*b; } else { y=0; } return x+y+4; }
+20|main() { a=3; b=4; x=a*b; if (x>5) a=1; y=a*b; return x+y+4; }
+22|main() { a=1; b=2; s=0; for (i=0; i<3; i=i+1) { s=s+a*b; a=a+1; } return s+a*b+2; }
+EOF
+echo "common subexpression elimination => OK"
+
+# constant loops run while compiling (-O), within -fconstexpr-steps; loops with a known trip count are unrolled
+echo 'main() { j=0; for (i=0; i<=10; i=i+1) j=i+j; return j; }' > tmp1.c
+./chibicc-wyj -O -o tmp.s tmp1.c || exit
+grep -q '\$55' tmp.s && ! grep -q 'jne\|je ' tmp.s || { echo "constant loop => 55 without a branch expected"; exit 1; }
+./chibicc-wyj -O -fconstexpr-steps=10 -funroll-factor=3 -o tmp.s tmp1.c || exit
+[ "$(grep -c '^.L.BEGIN' tmp.s)" = 1 ] && [ "$(grep -c 'jne\|je ' tmp.s)" = 1 ] || { echo "unrolled loop => one bottom test expected"; exit 1; }
+while IFS='|' read -r expected input; do
+    for flags in "" "-fconstexpr-steps=0" "-fconstexpr-steps=0 -funroll-factor=3"; do
+        echo "$input" | ./chibicc-wyj -O $flags -o tmp.s - || exit
+        gcc -static -o tmp tmp.s
+        ./tmp
+        actual="$?"
+        if [ "$actual" != "$expected" ]; then
+            echo "-O $flags $input => $expected expected, but got $actual"
+            exit 1
+        fi
+    done
+done <<'EOF'
+55|main() { j=0; for (i=0; i<=10; i=i+1) j=i+j; return j; }
+55|main() { j=0; for (i=10; i>0; i=i-1) j=i+j; return j; }
+34|main() { j=0; for (i=0; i<10; i=i+3) j=i+j+1; return j+i; }
+7|main() { j=7; for (i=5; i<3; i=i+1) j=j+1; return j; }
+100|main() { s=0; for (i=0; i<10; i=i+1) for (j=0; j<10; j=j+1) s=s+1; return s; }
+111|main() { s=0; n=0; while (s<100) { s=s+n; n=n+1; } return s+n-9; }
+30|main() { s=0; k=1; for (i=0; i<4; i=i+1) { if (i==2) k=k+1; s=s+k; } return s*6-2-i; }
+3|f(x) { return x; } main() { s=0; for (i=0; i<3; i=i+1) s=s+f(1); return s; }
+12|main() { a=2; s=0; for (i=0; i<3; i=i+1) { t=0; for (j=0; j<2; j=j+1) t=t+a; s=s+t; } return s; }
+EOF
+echo "loop evaluation and unrolling => OK"
+
+# loop-invariant code motion (-O): invariant arithmetic moves in front of the loop, unless a store may reach it
+echo 'read() { return 5; } main() { a=3; b=4; s=0; n=read(); for (i=0; i<n; i=i+1) s=s+a*b; return s; }' > tmp1.c
+./chibicc-wyj -O -o tmp.s tmp1.c || exit
+sed -n '/^main:/,/^.L.BEGIN/p' tmp.s | grep -q imul || { echo "licm => imul before the loop expected"; exit 1; }
+while IFS='|' read -r expected input; do
+    echo "read() { return 5; } bump(p) { *p=*p+1; return 0; } $input" | ./chibicc-wyj -O -o tmp.s - || exit
+    gcc -static -o tmp tmp.s
+    ./tmp
+    actual="$?"
+    if [ "$actual" != "$expected" ]; then
+        echo "-O $input => $expected expected, but got $actual"
+        exit 1
+    fi
+done <<'EOF'
+60|main() { a=3; b=4; s=0; n=read(); for (i=0; i<n; i=i+1) s=s+a*b; return s; }
+100|main() { a=3; b=4; s=0; n=read(); for (i=0; i<n; i=i+1) { s=s+a*b; a=a+1; } return s; }
+50|main() { a=3; p=&a; s=0; n=read(); for (i=0; i<n; i=i+1) { s=s+a*2; *p=*p+1; } return s; }
+50|main() { a=3; p=&a; s=0; n=read(); for (i=0; i<n; i=i+1) { s=s+a*2; bump(p); } return s; }
+25|main() { x=3; y=5; s=0; n=read(); for (i=0; i<n; i=i+1) s=s+*(&x+1); return s; }
+200|main() { x=1; y=2; s=0; n=read(); for (i=0; i<n; i=i+1) { k=2; for (j=0; j<n; j=j+1) s=s+x*y+k*3; } return s; }
+EOF
+echo "loop-invariant code motion => OK"
+
+# pipelined front end: same code as the sequential one, errors of every batch are reported
+{ for i in $(seq 500); do echo "f$i(a, b) { x=a; for (i=0; i<b; i=i+1) x=x+i*$i; if (x>100) return x-100; return x; }"; done
+  echo 'main() { return f7(1, 3)+f300(2, 2); }'; } > tmp.c
+./chibicc-wyj -o tmp1.s tmp.c || exit
+./chibicc-wyj --pipeline -o tmp2.s tmp.c || exit
+cmp -s tmp1.s tmp2.s || { echo "pipelined output mismatch"; exit 1; }
+gcc -static -o tmp tmp2.s
+./tmp
+actual="$?"
+if [ "$actual" != 224 ]; then
+    echo "pipelined build => 224 expected, but got $actual"
+    exit 1
+fi
+# a two-byte character is two invalid tokens, found by the lexer thread
+sed -i -e '3s/x=a;/x=aé;/' -e '450s/return x; }/return x }/' tmp.c
+./chibicc-wyj --pipeline -o tmp2.s tmp.c 2> tmp.err && { echo "error expected"; exit 1; }
+if [ "$(grep -o '^tmp.c:[0-9]*:[0-9]*' tmp.err | tr '\n' ' ')" != "tmp.c:3:15 tmp.c:3:16 tmp.c:450:86 " ]; then
+    echo "pipelined diagnostics => tmp.c:3:15 tmp.c:3:16 tmp.c:450:86 expected, but got:"; cat tmp.err; exit 1
+fi
+echo "pipelined front end => OK"
+
+# binary AST: --from-ast produces the same code as compiling the source
+echo 'add(a, b) { return a+b; } main() { x=3; y=5; *(&y-2+1)=7; j=0; for (i=0; i<=10; i=i+1) j=add(i, j); return x+j; }' > tmp1.c
+./chibicc-wyj -o tmp.s tmp1.c || exit
+./chibicc-wyj --emit-ast -o tmp.ast tmp1.c || exit
+./chibicc-wyj --from-ast -o tmp2.s tmp.ast || exit
+if ! cmp -s tmp.s tmp2.s; then
+    echo "binary AST round trip mismatch"; exit 1
+fi
+# a deep AST is written without recursion
+{ echo -n '{ return 0'; for i in $(seq 300000); do echo -n '+1'; done; echo '; }'; } > tmp.c
+./chibicc-wyj --emit-ast -o tmp.ast tmp.c || { echo "deep binary AST => emit failed"; exit 1; }
+# a link back to an earlier node (here `next` of the root to itself) would be a cycle
+echo '{ return 1; }' > tmp1.c
+./chibicc-wyj --emit-ast -o tmp.ast tmp1.c || exit
+printf '\0\0\0\0' | dd of=tmp.ast bs=1 seek=112 conv=notrunc 2> /dev/null
+./chibicc-wyj --from-ast -o tmp2.s tmp.ast 2> tmp.err && { echo "error expected"; exit 1; }
+if ! grep -q 'is not forward' tmp.err; then
+    echo "binary AST cycle => error expected"; cat tmp.err; exit 1
+fi
+# a node without a child its kind requires (here `lhs` of the `+`) is rejected, not generated
+echo '{ return 1+2; }' > tmp1.c
+./chibicc-wyj --emit-ast -o tmp.ast tmp1.c || exit
+printf '\377\377\377\377' | dd of=tmp.ast bs=1 seek=240 conv=notrunc 2> /dev/null
+./chibicc-wyj --from-ast -o tmp2.s tmp.ast 2> tmp.err
+if [ "$?" != 1 ] || ! grep -q 'lacks a required child' tmp.err; then
+    echo "binary AST missing child => error expected"; cat tmp.err; exit 1
+fi
+echo "binary AST => OK"
+
+# compilation cache: the second compile is served from the cache
+cache_dir="$tmp_dir/cache"
+echo '{ return 1; }' > tmp1.c
+./chibicc-wyj --cache-dir="$cache_dir" --cache-stats -o tmp.s tmp1.c 2> tmp.err || exit
+./chibicc-wyj --cache-dir="$cache_dir" --cache-stats -o tmp.s tmp1.c 2>> tmp.err || exit
+if ! grep -q '^cache: 1 hits, 0 misses' tmp.err; then
+    echo "cache hit expected"; cat tmp.err; exit 1
+fi
+gcc -static -o tmp tmp.s
+./tmp
+if [ "$?" != 1 ]; then
+    echo "cached output mismatch"; exit 1
+fi
+
+# over --cache-size the oldest entries go, down to 3/4 of the limit, so the cache stays under it
+rm -rf "$cache_dir"/*
+for i in $(seq 20); do echo "{ a=$i; return a; }" > tmp$i.c; done
+./chibicc-wyj --cache-dir="$cache_dir" --cache-size=4K --cache-stats -j1 $(seq -f 'tmp%g.c' 20) 2> tmp.err || exit
+size=$(find "$cache_dir" -mindepth 2 -type f -exec cat {} + | wc -c)
+if grep -q ' 0 evicted' tmp.err || [ "$size" -gt 4096 ]; then
+    echo "cache eviction => at most 4096 bytes expected, but got $size"; cat tmp.err; exit 1
+fi
+
+# concurrent compilers storing the same keys: the recorded size is exact and under the limit
+rm -rf "$cache_dir"
+for i in $(seq 40); do echo "{ a=$i; return a; }" > tmp$i.c; done
+for j in 1 2 3 4; do
+    ./chibicc-wyj --cache-dir="$cache_dir" --cache-size=4K -j4 $(seq -f 'tmp%g.c' 40) &
+done
+wait
+size=$(find "$cache_dir" -mindepth 2 -type f -exec cat {} + | wc -c)
+recorded=$(od -An -t d8 "$cache_dir/size" | tr -d ' ')
+if [ "$size" -gt 4096 ] || [ "$recorded" != "$size" ]; then
+    echo "concurrent cache => $size bytes recorded as $recorded, at most 4096 expected"; exit 1
+fi
+rm -rf "$cache_dir" tmp[0-9]*.s
+echo "compilation cache => OK"
+
+# streaming (--stream): same results statement by statement, in memory which doesn't grow with the input
+while IFS='|' read -r expected input; do
+    echo "$input" | ./chibicc-wyj --stream -o tmp.s - || exit
+    gcc -static -o tmp tmp.s
+    ./tmp
+    actual="$?"
+    if [ "$actual" != "$expected" ]; then
+        echo "--stream $input => $expected expected, but got $actual"; exit 1
+    fi
+done <<'EOF'
+55|fib(n) { if (n<=1) return n; return fib(n-1)+fib(n-2); } main() { return fib(10); }
+45|{ s=0; for (i=0; i<10; i=i+1) { t=i; s=s+t; } return s; }
+7|{ x=3; y=&x; *y=7; if (x==7) { return x; } else return 0; }
+3|{ a=1; { b=2; { return a+b; } } }
+EOF
+{ for k in $(seq 100); do
+    echo "f$k(a) { x = a;"; yes 'x = x + 3; if (x > 100000) { x = x - 100000; }' | head -300; echo 'return x; }'
+  done; echo 'main() { return f7(7) - f9(9); }'; } > tmp.c
+( ulimit -v 40000; ./chibicc-wyj --stream -o tmp.s tmp.c ) || { echo "--stream out of memory"; exit 1; }
+gcc -static -o tmp tmp.s
+./tmp
+actual="$?"
+if [ "$actual" != 254 ]; then
+    echo "--stream large input => 254 expected, but got $actual"; exit 1
+fi
+printf '{\n  a = 1;\n  b = ;\n  if (a) { c = 2 d; }\n  return 1 }\n' > tmp1.c
+./chibicc-wyj --stream -o tmp.s tmp1.c 2> tmp.err && { echo "error expected"; exit 1; }
+if [ "$(grep -c ': error: ' tmp.err)" != 3 ] || ! grep -q '^tmp1.c:4:18: error: ' tmp.err; then
+    echo "--stream diagnostics mismatch"; cat tmp.err; exit 1
+fi
+echo "streaming compilation => OK"
+
 echo ====TEST OK!=====
@@ -10,9 +10,125 @@
  */
 
 #include "chibicc_wyj.h"
+#include <pthread.h>
+#include <stdatomic.h>
 
-// Input string
-static char *current_input;
+// Input buffer, it is not NUL-terminated when mapped from a file
+static _Thread_local char *current_input;
+static _Thread_local size_t current_input_len;
+static _Thread_local char *current_filename;
+
+// Line index of the input: offset of the first character of each line,
+// built on demand up to the lines diagnostics and debug info ask for
+static _Thread_local int *line_starts;
+static _Thread_local int line_cnt;
+static _Thread_local int line_cap;
+static _Thread_local char *lines_scanned;
+
+// Errors reported so far for the current input, compilation stops at the limit
+static _Thread_local int error_cnt;
+static int error_limit = 20;
+
+// Where to jump after reporting a recoverable error, e.g. to resync the parser
+static _Thread_local jmp_buf *recovery_trap;
+static _Thread_local char *error_loc;
+
+// Diagnostics sink of current thread, NULL means stderr
+static _Thread_local FILE *diag_output;
+
+// Where to jump when a fatal error happens, NULL means exit the process
+static _Thread_local jmp_buf *error_trap;
+
+static FILE *diag(void) {
+    return diag_output ? diag_output : stderr;
+}
+
+// redirect diagnostics of current thread, e.g. into a per-file buffer
+void set_diag_output(FILE *out) {
+    diag_output = out;
+}
+
+// install a recovery point for fatal errors, return the previous one
+jmp_buf *set_error_trap(jmp_buf *trap) {
+    jmp_buf *prev = error_trap;
+    error_trap = trap;
+    return prev;
+}
+
+// install a recovery point for errors which the caller can resync from
+jmp_buf *set_recovery_trap(jmp_buf *trap) {
+    jmp_buf *prev = recovery_trap;
+    recovery_trap = trap;
+    return prev;
+}
+
+// location of the last reported error
+char *last_error_loc(void) {
+    return error_loc;
+}
+
+bool has_errors(void) {
+    return error_cnt > 0;
+}
+
+void set_error_limit(int limit) {
+    error_limit = limit;
+}
+
+// abort current compilation
+void fatal(void) {
+    if (error_trap)
+        longjmp(*error_trap, 1);
+    exit(1);
+}
+
+static void add_line(int offset) {
+    if (line_cnt == line_cap) {
+        line_cap = line_cap ? line_cap * 2 : 1024;
+        line_starts = realloc(line_starts, line_cap * sizeof(int));
+    }
+    line_starts[line_cnt++] = offset;
+}
+
+// extend the line index past the line of `loc`, so that its end is known too
+static void index_lines(char *loc) {
+    char *end = current_input + current_input_len;
+    while (lines_scanned < end && lines_scanned <= loc) {
+        char *nl = memchr(lines_scanned, '\n', end - lines_scanned);
+        if (!nl) {
+            lines_scanned = end;
+            break;
+        }
+        add_line(nl + 1 - current_input);
+        lines_scanned = nl + 1;
+    }
+}
+
+// 1-based line number of `loc`, binary search in the line index
+static int find_line(char *loc) {
+    index_lines(loc);
+    int off = loc - current_input;
+    int lo = 0, hi = line_cnt - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (line_starts[mid] <= off)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo + 1;
+}
+
+// name of the current input, as diagnostics print it
+char *input_filename(void) {
+    return current_filename;
+}
+
+// 1-based line and column of `loc` in the current input, e.g. for debug line info
+void line_col(char *loc, int *line, int *col) {
+    *line = find_line(loc);
+    *col = loc - (current_input + line_starts[*line - 1]) + 1;
+}
 
 // Debug
 static void dump_token(Token *tok) {
@@ -24,23 +140,52 @@ static void dump_token(Token *tok) {
 void error(char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, " [%s:%d]", __FILE__, __LINE__);
-    fprintf(stderr, "\n");
-    exit(1);
+    vfprintf(diag(), fmt, ap);
+    fprintf(diag(), " [%s:%d]", __FILE__, __LINE__);
+    fprintf(diag(), "\n");
+    fatal();
 }
 
-// print error masseage and detail location, then exit
+/**
+ * @brief print "file:line:col: error: message", then only the offending line with a caret
+ * 
+ * Looking up the line is a binary search in the line index, so reporting an
+ * error never scans the whole input.
+ */
+static void report_at(char *loc, char *fmt, va_list ap) {
+    int line_no = find_line(loc);
+    char *line = current_input + line_starts[line_no - 1];
+    char *end = current_input + (line_no < line_cnt ? line_starts[line_no] : current_input_len);
+    while (end > line && (end[-1] == '\n' || end[-1] == '\r'))
+        end--;
+    int col = loc - line;
+
+    fprintf(diag(), "%s:%d:%d: error: ", current_filename, line_no, col + 1);
+    vfprintf(diag(), fmt, ap);
+    fprintf(diag(), "\n%.*s\n", (int)(end - line), line);
+    fprintf(diag(), "%*s^\n", col, "");
+
+    error_loc = loc;
+    if (++error_cnt >= error_limit) {
+        fprintf(diag(), "%s: too many errors emitted, stopping now\n", current_filename);
+        fatal();
+    }
+}
+
+// print error message and detail location, then resync at the recovery point or stop
 static void verror_at(char *loc, char *fmt, va_list ap) {
-    int pos = loc - current_input;
-    fprintf(stderr, "%s", current_input);
-    fprintf(stderr, " [%s:%d]\n", __FILE__, __LINE__);
-    if (pos != 0)
-        fprintf(stderr, "%*s", pos, " ");
-    fprintf(stderr, "^ ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    report_at(loc, fmt, ap);
+    if (recovery_trap)
+        longjmp(*recovery_trap, 1);
+    fatal();
+}
+
+// report an error and keep going, e.g. the tokenizer skips an invalid character
+static void warn_at(char *loc, char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    report_at(loc, fmt, ap);
+    va_end(ap);
 }
 
 void error_at(char *loc, char *fmt, ...) {
@@ -55,9 +200,83 @@ void error_tok(Token *tok, char *fmt, ...) {
     verror_at(tok->loc, fmt, ap);
 }
 
-// Create a new token with calloc
+// read from a pipe/terminal into a growing buffer
+static char *read_stream(int fd, size_t *len) {
+    size_t cap = 4096;
+    size_t n = 0;
+    char *buf = malloc(cap);
+    for (;;) {
+        if (n == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        ssize_t r = read(fd, buf + n, cap - n);
+        if (r == 0)
+            break;
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            free(buf);
+            return NULL;
+        }
+        n += r;
+    }
+    *len = n;
+    return buf;
+}
+
+/**
+ * @brief load source text, "-" means stdin
+ *
+ * Regular files are mapped read-only and never copied, tokens point straight
+ * into the mapping. The buffer is NOT NUL-terminated, use `len`.
+ *
+ * @param mapped set to whether the buffer is a mapping, which `free_file` needs; may be NULL
+ */
+char *read_file(char *path, size_t *len, bool *mapped) {
+    int fd = strcmp(path, "-") ? open(path, O_RDONLY) : STDIN_FILENO;
+    if (fd == -1)
+        error("cannot open %s: %s", path, strerror(errno));
+
+    // the descriptor is closed before any error, which may not return
+    struct stat st;
+    char *buf = NULL;
+    char *failed = NULL;
+    *len = 0;
+    if (fstat(fd, &st) == -1) {
+        failed = "stat";
+    } else if (!S_ISREG(st.st_mode)) {
+        buf = read_stream(fd, len);
+        failed = buf ? NULL : "read";
+    } else if (st.st_size == 0) {
+        buf = calloc(1, 1);
+    } else {
+        *len = st.st_size;
+        buf = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+        failed = buf != MAP_FAILED ? NULL : "map";
+    }
+
+    int err = errno;
+    if (fd != STDIN_FILENO)
+        close(fd);
+    if (failed)
+        error("cannot %s %s: %s", failed, path, strerror(err));
+    if (mapped)
+        *mapped = S_ISREG(st.st_mode) && *len > 0;
+    return buf;
+}
+
+// release a buffer of `read_file`
+void free_file(char *buf, size_t len, bool mapped) {
+    if (mapped)
+        munmap(buf, len);
+    else
+        free(buf);
+}
+
+// Create a new token, in the statement arena when streaming
 static Token *new_token(TokenKind kind, char *start, char *end) {
-    Token *tok = (Token *)calloc(1, sizeof(Token));
+    Token *tok = arena_alloc(sizeof(Token));
     tok->kind = kind;
     tok->loc = start;
     tok->len = end - start;
@@ -82,7 +301,7 @@ Token *skip(Token *tok, char *s) {
     if (!equal(tok, s)) {
         error_tok(tok, "expected '%s'", s);
     }
-    return tok->next;
+    return next_token(tok);
 }
 
 static bool is_keyword(Token *tok) {
@@ -97,67 +316,458 @@ static bool is_keyword(Token *tok) {
 
 // recognize keywords from TK_IDENT
 static void recognize_keywords(Token *tok) {
-    for (Token *t = tok; t->kind != TK_EOF; t = t->next) {
-        if (t->kind == TK_IDENT && is_keyword(tok)) {
+    // a pipelined batch may end without TK_EOF
+    for (Token *t = tok; t && t->kind != TK_EOF; t = t->next) {
+        if (t->kind == TK_IDENT && is_keyword(t)) {
             t->kind = TK_KEYWORD;
         }
     }
 }
 
+// make `p` the input that diagnostics refer to, and reset error state
+static void start_input(char *name, char *p, size_t len) {
+    current_filename = name;
+    current_input = p;
+    current_input_len = len;
+    line_cnt = 0;
+    add_line(0);
+    lines_scanned = p;
+    error_cnt = 0;
+    error_loc = NULL;
+    recovery_trap = NULL;
+}
+
+// same as above, for an input which isn't tokenized (e.g. the source saved in a binary AST)
+void use_input(char *name, char *p, size_t len) {
+    start_input(name, p, len);
+}
+
+static bool is_ident1(char c) {
+    return c >= 'a' && c <= 'z' || c >= 'A' && c <= 'Z';
+}
+
+static bool is_ident2(char c) {
+    return is_ident1(c) || isdigit((unsigned char)c);
+}
+
+/**
+ * @brief scan the token after any white space at `*rest` into `tok`
+ * 
+ * Touches no per-input state, so the lexer thread of a pipelined compilation
+ * can run it too.
+ * 
+ * @param invalid set to an invalid character which was skipped, NULL otherwise
+ * @return false at the end of input or on an invalid character
+ */
+static bool scan_token(char **rest, char *end, char **invalid, Token *tok) {
+    char *p = *rest;
+    bool found = true;
+    *invalid = NULL;
+    *tok = (Token){};
+
+    while (p < end && isspace((unsigned char)*p))
+        p++;
+
+    if (p == end) {
+        // nothing left
+        found = false;
+    }
+    // TK_IDENT / TK_KEYWORD
+    else if (is_ident1(*p)) {
+        char *st = p;
+        do {
+            p = p + 1;
+        } while (p < end && is_ident2(*p));
+        *tok = (Token){TK_IDENT, 0, st, p - st};
+    }
+    else if (ispunct((unsigned char)*p)) {
+        if (p + 1 < end &&
+           ((*p == '=' && *(p+1) == '=') ||
+            (*p == '!' && *(p+1) == '=') || 
+            (*p == '<' && *(p+1) == '=') ||
+            (*p == '>' && *(p+1) == '='))) {
+            *tok = (Token){TK_PUNCT, 0, p, 2};
+            p = p + 2;
+        } else {
+            *tok = (Token){TK_PUNCT, 0, p, 1};
+            p++;
+        }
+    } else if (isdigit((unsigned char)*p)) {
+        // no strtol here: the mapped buffer has no terminator to stop it
+        char *st = p;
+        long value = 0;
+        while (p < end && isdigit((unsigned char)*p)) {
+            value = value * 10 + (*p - '0');
+            p++;
+        }
+        *tok = (Token){TK_NUM, value, st, p - st};
+    }
+    else {
+        *invalid = p;
+        p++;
+        found = false;
+    }
+
+    *rest = p;
+    return found;
+}
+
+// same as above, in a new token; NULL if there is none
+static Token *lex_token(char **rest, char *end, char **invalid) {
+    Token tok;
+    if (!scan_token(rest, end, invalid, &tok))
+        return NULL;
+    Token *t = new_token(tok.kind, tok.loc, tok.loc + tok.len);
+    t->value = tok.value;
+    return t;
+}
+
 /**
  * @brief split input into a list of tokens
  * 
- * @param p pointer of input string
+ * @param name file name used by diagnostics
+ * @param p pointer of input buffer
+ * @param len length of input buffer, `p` needn't be NUL-terminated
  * @return Token* 
  */
-Token *tokenize(char *p) {
+Token *tokenize(char *name, char *p, size_t len) {
     // save input string into global pointer
-    current_input = p;
+    start_input(name, p, len);
+    char *end = p + len;
     Token head = {};
     Token *cur = &head;
 
-    while (*p) {
-        // white space
-        if (isspace(*p)) {
-            p++;
+    while (p < end) {
+        char *invalid;
+        Token *tok = lex_token(&p, end, &invalid);
+        if (invalid)
+            warn_at(invalid, "invalid token");
+        if (tok)
+            cur = cur->next = tok;
+    }
+    cur->next = new_token(TK_EOF, p, p);
+
+    recognize_keywords(head.next);
+    return head.next;
+}
+
+//
+// Pipelined tokenize: a lexer thread splits the input into batches and hands them
+// over through a single-producer/single-consumer ring. The batches form one token
+// list, which the compiling thread parses while the lexer thread is still extending it
+//
+
+// a batch ends at the first ";" or "}" once it holds this many tokens
+#define BATCH_TOKENS 4096
+// batches in flight, a power of 2
+#define RING_SIZE 64
+// polls of an empty or full ring before the thread sleeps
+#define SPIN_LIMIT 1024
+
+typedef struct {
+    Token *tok;         // the last token is TK_EOF, or a ";" / "}" whose `next` is the next batch
+    char **invalid;     // invalid characters, reported by the consumer
+    int ninvalid;
+} Batch;
+
+typedef struct {
+    char *p;
+    char *end;
+    Batch *slots[RING_SIZE];
+    _Atomic size_t head;    // next slot to consume, written by the consumer only
+    _Atomic size_t tail;    // next slot to fill, written by the lexer only
+    atomic_bool cancel;     // the consumer gave up, e.g. after a fatal error
+    // where a thread sleeps after SPIN_LIMIT polls: the consumer on an empty ring,
+    // the lexer on a full one. It sets its flag first, so that the other thread
+    // takes the lock only when there is someone to wake
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    atomic_bool lexer_sleeps;
+    atomic_bool consumer_sleeps;
+    pthread_t thread;
+} AsyncLexer;
+
+static _Thread_local AsyncLexer *async_lexer;
+
+/**
+ * @brief wake the thread whose flag is `sleeps`, if it sleeps, after `head`, `tail`
+ *        or `cancel` changed
+ *
+ * The change and the flag are both stored and loaded sequentially consistent: either
+ * the sleeper re-checks the ring after the change, or this sees its flag and signals
+ * under the lock, which the sleeper holds until it waits.
+ */
+static void ring_wake(AsyncLexer *lx, atomic_bool *sleeps) {
+    if (!atomic_load(sleeps))
+        return;
+    pthread_mutex_lock(&lx->lock);
+    pthread_cond_signal(&lx->changed);
+    pthread_mutex_unlock(&lx->lock);
+}
+
+// false if the consumer cancelled while the ring was full
+static bool ring_push(AsyncLexer *lx, Batch *batch) {
+    size_t tail = atomic_load_explicit(&lx->tail, memory_order_relaxed);
+    for (int spin = 0; tail - atomic_load_explicit(&lx->head, memory_order_acquire) == RING_SIZE; spin++) {
+        if (atomic_load_explicit(&lx->cancel, memory_order_relaxed))
+            return false;
+        if (spin < SPIN_LIMIT)
             continue;
-        }
+        pthread_mutex_lock(&lx->lock);
+        atomic_store(&lx->lexer_sleeps, true);
+        while (tail - atomic_load(&lx->head) == RING_SIZE && !atomic_load(&lx->cancel))
+            pthread_cond_wait(&lx->changed, &lx->lock);
+        atomic_store(&lx->lexer_sleeps, false);
+        pthread_mutex_unlock(&lx->lock);
+    }
+    lx->slots[tail % RING_SIZE] = batch;
+    atomic_store(&lx->tail, tail + 1);
+    ring_wake(lx, &lx->consumer_sleeps);
+    return true;
+}
 
-        // TK_IDENT / TK_KEYWORD
-        if (*p >= 'a' && *p <= 'z' || *p >= 'A' && *p <= 'Z') {
-            char *st = p;
-            do {
-                p = p + 1;
-            } while (*p >= 'a' && *p <= 'z' || *p >= 'A' && *p <= 'Z' || isdigit(*p));
-            cur->next = new_token(TK_IDENT, st, p);
-            cur = cur->next;
-        }
-        else if (ispunct(*p)) {
-            if ((*p == '=' && *(p+1) == '=') ||
-                (*p == '!' && *(p+1) == '=') || 
-                (*p == '<' && *(p+1) == '=') ||
-                (*p == '>' && *(p+1) == '=')) {
-               cur->next = new_token(TK_PUNCT, p, p+2);
-               cur = cur->next;
-               p = p + 2;
-               continue;
+static Batch *ring_pop(AsyncLexer *lx) {
+    size_t head = atomic_load_explicit(&lx->head, memory_order_relaxed);
+    for (int spin = 0; atomic_load_explicit(&lx->tail, memory_order_acquire) == head; spin++) {
+        if (spin < SPIN_LIMIT)
+            continue;
+        pthread_mutex_lock(&lx->lock);
+        atomic_store(&lx->consumer_sleeps, true);
+        while (atomic_load(&lx->tail) == head)
+            pthread_cond_wait(&lx->changed, &lx->lock);
+        atomic_store(&lx->consumer_sleeps, false);
+        pthread_mutex_unlock(&lx->lock);
+    }
+    Batch *batch = lx->slots[head % RING_SIZE];
+    atomic_store(&lx->head, head + 1);
+    ring_wake(lx, &lx->lexer_sleeps);
+    return batch;
+}
+
+static void *lexer_main(void *arg) {
+    AsyncLexer *lx = arg;
+    char *p = lx->p;
+
+    for (;;) {
+        Batch *batch = calloc(1, sizeof(Batch));
+        Token head = {};
+        Token *cur = &head;
+        int ntoks = 0, cap = 0;
+        bool cut = false;
+
+        while (p < lx->end && !atomic_load_explicit(&lx->cancel, memory_order_relaxed)) {
+            char *invalid;
+            Token *tok = lex_token(&p, lx->end, &invalid);
+            if (invalid) {
+                if (batch->ninvalid == cap) {
+                    cap = cap ? cap * 2 : 16;
+                    batch->invalid = realloc(batch->invalid, cap * sizeof(char *));
+                }
+                batch->invalid[batch->ninvalid++] = invalid;
+            }
+            if (!tok)
+                continue;
+            cur = cur->next = tok;
+            // the parser waits at the end of a statement, not inside a token sequence it peeks into
+            if (++ntoks >= BATCH_TOKENS && (equal(tok, ";") || equal(tok, "}")) && p < lx->end) {
+                cut = true;
+                break;
             }
-            cur->next = new_token(TK_PUNCT, p, p+1);
-            cur = cur->next;
-            p++;
-        } else if (isdigit(*p)) {
-            cur->next = new_token(TK_NUM, p, p);
-            char *p_pre = p;
-            cur->next->value = strtol(p, &p, 10);
-            cur->next->len = p - p_pre;
-            cur = cur->next;
         }
-        else {
-            error_at(p, "invalid token");
+        if (atomic_load_explicit(&lx->cancel, memory_order_relaxed)) {
+            free(batch->invalid);
+            free(batch);
+            return NULL;
         }
+        if (!cut)
+            cur = cur->next = new_token(TK_EOF, p, p);
+        recognize_keywords(head.next);
+        batch->tok = head.next;
+        if (!ring_push(lx, batch) || !cut)
+            return NULL;
     }
-    cur->next = new_token(TK_EOF, p, p);
+}
+
+// start tokenizing `p` on a lexer thread, `async_tokens` takes the results
+void tokenize_async(char *name, char *p, size_t len) {
+    start_input(name, p, len);
+    AsyncLexer *lx = calloc(1, sizeof(AsyncLexer));
+    lx->p = p;
+    lx->end = p + len;
+    pthread_mutex_init(&lx->lock, NULL);
+    pthread_cond_init(&lx->changed, NULL);
+    if (pthread_create(&lx->thread, NULL, lexer_main, lx) != 0)
+        error("pthread_create failed");
+    async_lexer = lx;
+}
+
+// wait for the next batch, report its invalid characters
+static Token *take_batch(AsyncLexer *lx) {
+    Batch *batch = ring_pop(lx);
+    Token *tok = batch->tok;
+    char **invalid = batch->invalid;
+    int ninvalid = batch->ninvalid;
+    free(batch);
+    for (int i = 0; i < ninvalid; i++) {
+        warn_at(invalid[i], "invalid token");
+    }
+    free(invalid);
+    return tok;
+}
 
+/**
+ * @brief the token list of the input given to `tokenize_async`
+ * 
+ * The lexer thread is still extending it: `next_token` waits for the rest.
+ */
+Token *async_tokens(void) {
+    return take_batch(async_lexer);
+}
+
+/**
+ * @brief the token after `tok`, which the parser takes after a ";" or "}"
+ * 
+ * The last token of a pipelined batch has no `next` yet: wait for the lexer
+ * thread and link its next batch.
+ */
+Token *next_token(Token *tok) {
+    if (!tok->next && tok->kind != TK_EOF && async_lexer)
+        tok->next = take_batch(async_lexer);
+    return tok->next;
+}
+
+// stop the lexer thread, if any, whether or not all batches were taken
+void tokenize_async_end(void) {
+    AsyncLexer *lx = async_lexer;
+    if (!lx)
+        return;
+    atomic_store(&lx->cancel, true);
+    ring_wake(lx, &lx->lexer_sleeps);
+    pthread_join(lx->thread, NULL);
+    size_t head = atomic_load(&lx->head), tail = atomic_load(&lx->tail);
+    for (; head != tail; head++) {
+        free(lx->slots[head % RING_SIZE]->invalid);
+        free(lx->slots[head % RING_SIZE]);
+    }
+    pthread_mutex_destroy(&lx->lock);
+    pthread_cond_destroy(&lx->changed);
+    free(lx);
+    async_lexer = NULL;
+}
+
+//
+// Streaming tokenize: the tokens of one function header or one statement at a
+// time, allocated in the statement arena, so memory doesn't grow with the input
+//
+
+static _Thread_local char *stream_p;
+static _Thread_local char *stream_end;
+
+// start reading `p` a statement at a time, `stream_tokens` takes the results
+void tokenize_stream(char *name, char *p, size_t len) {
+    start_input(name, p, len);
+    stream_p = p;
+    stream_end = p + len;
+}
+
+// whether the token after `p` is `op`
+static bool peek_token(char *p, char *op) {
+    Token tok;
+    char *invalid;
+    // invalid characters are reported once the token is really read
+    while (!scan_token(&p, stream_end, &invalid, &tok)) {
+        if (p == stream_end)
+            return false;
+    }
+    return equal(&tok, op);
+}
+
+/**
+ * @brief tokens of the next function header, or of the next statement of a function body,
+ *        terminated by TK_EOF, which is all there is at the end of input
+ * 
+ * A header ends with the "{" which opens the body. A statement ends with a ";" or
+ * a "}" outside of parentheses and braces, unless an "else" follows; a "}" which
+ * closes the body is returned alone.
+ */
+Token *stream_tokens(bool header) {
+    Token head = {};
+    Token *cur = &head;
+    int parens = 0, braces = 0;
+    char *eof = NULL;
+
+    while (stream_p < stream_end) {
+        char *start = stream_p;
+        char *invalid;
+        Token *tok = lex_token(&stream_p, stream_end, &invalid);
+        if (invalid)
+            warn_at(invalid, "invalid token");
+        if (!tok)
+            continue;
+
+        // the body ends: give the "}" on its own
+        if (!header && braces == 0 && equal(tok, "}") && cur != &head) {
+            stream_p = start;
+            eof = tok->loc;
+            break;
+        }
+        cur = cur->next = tok;
+
+        if (equal(tok, "("))
+            parens++;
+        else if (equal(tok, ")") && parens > 0)
+            parens--;
+        else if (equal(tok, "{") && header)
+            break;
+        else if (equal(tok, "{"))
+            braces++;
+        else if (equal(tok, "}") && braces > 0)
+            braces--;
+
+        if (header || parens > 0 || braces > 0)
+            continue;
+        if ((equal(tok, ";") || equal(tok, "}")) && !peek_token(stream_p, "else"))
+            break;
+    }
+
+    // a statement cut short ends where the "}" is, as in a whole body
+    eof = eof ? eof : stream_p;
+    cur->next = new_token(TK_EOF, eof, eof);
     recognize_keywords(head.next);
     return head.next;
 }
+
+/**
+ * @brief walk the body which starts at the current position, up to its closing "}",
+ *        without reading it: `fn` gets each token and the one after it (NULL at the end)
+ * 
+ * The tokens live on the stack, nothing is allocated. Invalid characters are
+ * skipped, they are reported when the statements are read.
+ */
+void stream_prescan(void (*fn)(void *ctx, Token *tok, Token *next), void *ctx) {
+    char *p = stream_p;
+    char *invalid;
+    Token buf[2];
+    Token *tok = &buf[0], *next = &buf[1];
+    bool has_tok = false, has_next;
+    int depth = 1;
+
+    while (!(has_tok = scan_token(&p, stream_end, &invalid, tok)) && p < stream_end)
+        ;
+    while (has_tok) {
+        while (!(has_next = scan_token(&p, stream_end, &invalid, next)) && p < stream_end)
+            ;
+        if (tok->kind == TK_IDENT && is_keyword(tok))
+            tok->kind = TK_KEYWORD;
+        fn(ctx, tok, has_next ? next : NULL);
+
+        if (equal(tok, "{"))
+            depth++;
+        else if (equal(tok, "}") && --depth == 0)
+            return;
+        Token *tmp = tok;
+        tok = next;
+        next = tmp;
+        has_tok = has_next;
+    }
+}
@@ -1,38 +1,31 @@
 #include "chibicc_wyj.h"
 
 // global variable
-Type *ty_int = &(Type){TY_INT, NULL};
+Type *ty_int = &(Type){TY_INT, 8, 8, NULL};
 
 bool is_integer(Node *node) {
     return node->ty->kind == TY_INT;
 }
 
 // new a pointer type which points base type
-static Type *pointer_to(Type *base) {
-    Type *ty = calloc(1, sizeof(Type));
+Type *pointer_to(Type *base) {
+    Type *ty = arena_alloc(sizeof(Type));
     ty->kind = TY_PTR;
+    ty->size = 8;
+    ty->align = 8;
     ty->base = base;
     return ty;
 }
 
-// add type from node in AST, every statement is a independent AST
-void add_type(Node *node) {
-    // node is null or node already assigned type
-    if (!node || node->ty) {
+/**
+ * @brief infer the type of a single node from its (already typed) children
+ * 
+ * The parser calls this as every node is built, so each node is typed exactly
+ * once, bottom-up. Statement nodes have no type.
+ */
+void infer_type(Node *node) {
+    if (node->ty)
         return;
-    }
-    // recursive add type
-    add_type(node->lhs);
-    add_type(node->rhs);
-    add_type(node->next);
-    add_type(node->init);
-    add_type(node->inc);
-    add_type(node->cond);
-    add_type(node->then);
-    add_type(node->els);
-    for (Node *n=node->body; n; n=n->next) {
-        add_type(n);
-    }
 
     // detail rules of infer type
     switch (node->kind)
@@ -54,6 +47,7 @@ void add_type(Node *node) {
     case ND_GT:
     case ND_NUM:
     case ND_VAR:
+    case ND_FUNCALL:
         node->ty = ty_int;
         return;
 
@@ -62,11 +56,59 @@ void add_type(Node *node) {
         return;
     
     case ND_DEREF:
-        if (node->lhs->ty->kind != TY_PTR)
-            error_tok(node->tok, "DEREF kind isn't PTR [%s:%d]", __FILE__, __LINE__);
-        // point the lhs base type
-        node->ty = node->lhs->ty->base;
+        // variables are untyped so far, dereferencing one of them reads an int
+        if (node->lhs->ty->kind == TY_PTR)
+            node->ty = node->lhs->ty->base;
+        else
+            node->ty = ty_int;
         return;
     }
+}
+
+static void push(Node ***stack, int *cap, int *depth, Node *node) {
+    if (*depth == *cap) {
+        *cap *= 2;
+        *stack = realloc(*stack, *cap * sizeof(Node *));
+    }
+    (*stack)[(*depth)++] = node;
+}
 
-}
\ No newline at end of file
+/**
+ * @brief add types to a whole tree which wasn't built by the parser (fallback)
+ * 
+ * Post-order walk with an explicit stack instead of recursion, so the depth
+ * of the tree or the length of a statement list can't overflow the C stack.
+ * A node is visited twice: the first visit expands its children, the second
+ * one (marked by the low pointer bit) types it.
+ */
+void add_type(Node *node) {
+    int cap = 64, depth = 0;
+    Node **stack = malloc(cap * sizeof(Node *));
+    for (Node *n = node; n; n = n->next) {
+        push(&stack, &cap, &depth, n);
+    }
+
+    while (depth > 0) {
+        Node *n = stack[--depth];
+        if ((uintptr_t)n & 1) {
+            infer_type((Node *)((uintptr_t)n & ~(uintptr_t)1));
+            continue;
+        }
+        if (n->ty)
+            continue;
+
+        push(&stack, &cap, &depth, (Node *)((uintptr_t)n | 1));
+        Node *kids[] = {n->lhs, n->rhs, n->init, n->cond, n->then, n->els, n->inc};
+        for (int i = 0; i < sizeof(kids)/sizeof(*kids); i++) {
+            if (kids[i])
+                push(&stack, &cap, &depth, kids[i]);
+        }
+        for (Node *b = n->body; b; b = b->next) {
+            push(&stack, &cap, &depth, b);
+        }
+        for (Node *a = n->args; a; a = a->next) {
+            push(&stack, &cap, &depth, a);
+        }
+    }
+    free(stack);
+}